@@ -0,0 +1,59 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \ingroup cli
+ * \page cli_stream_throughput Stream Throughput
+ * Measures the frames per second of a Stream whose only stage is Identity,
+ * so that nearly all of the time is spent passing frames between stages.
+ */
+
+//! [stream_throughput]
+#include <QElapsedTimer>
+#include <openbr/openbr_plugin.h>
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv);
+
+    // Not a multiple of the gallery block size, so the last block read is a partial one
+    const int frames = 200001;
+    const QString algorithm = argc > 1 ? argv[1] : "Stream(Identity)";
+
+    // Stream reads each of its inputs as a gallery, so the frames are held in a memory gallery
+    br::TemplateList templates;
+    templates.reserve(frames);
+    for (int i=0; i<frames; i++)
+        templates.append(br::Template(br::File(QString::number(i)), cv::Mat(1, 1, CV_32FC1, cv::Scalar(i))));
+    QScopedPointer<br::Gallery> gallery(br::Gallery::make("stream_throughput.mem"));
+    gallery->writeBlock(templates);
+
+    QScopedPointer<br::Transform> stream(br::Transform::make(algorithm, NULL));
+    br::TemplateList input, output;
+    input.append(br::Template(br::File("stream_throughput.mem")));
+
+    QElapsedTimer timer;
+    timer.start();
+    stream->projectUpdate(input, output);
+    const qint64 elapsed = std::max(qint64(1), timer.elapsed());
+
+    printf("%s: %d frames in %lld ms, %.0f frames per second\n",
+           qPrintable(algorithm), output.size(), (long long) elapsed, 1000.0 * output.size() / elapsed);
+
+    br::Context::finalize();
+    return output.size() == frames ? 0 : 1;
+}
+//! [stream_throughput]
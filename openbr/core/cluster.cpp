@@ -16,9 +16,13 @@
 
 #include <QDebug>
 #include <QFile>
+#include <QFutureSynchronizer>
 #include <QHash>
 #include <QPair>
+#include <QScopedArrayPointer>
 #include <QSet>
+#include <QtConcurrentRun>
+#include <algorithm>
 #include <limits>
 #include <openbr/openbr_plugin.h>
 #include <assert.h>
@@ -478,6 +482,124 @@ void br::EvalClustering(const QString &csv, const QString &input, QString truth_
     qDebug("Recall: %f  Precision: %f  F-score: %f  Jaccard index: %f", wI, wII, sqrt(wI*wII), jaccard);
 }
 
+// Disjoint sets which several threads may unite at once.
+// Links only ever point to smaller indices, so the root of each set is its smallest index and no cycles can form.
+class ConcurrentUnionFind
+{
+    QScopedArrayPointer<QAtomicInt> parents;
+
+public:
+    explicit ConcurrentUnionFind(int size) : parents(new QAtomicInt[size])
+    {
+        for (int i=0; i<size; i++)
+            parents[i].store(i);
+    }
+
+    int find(int i)
+    {
+        int parent = parents[i].load();
+        while (parent != i) {
+            // Path halving, losing a race to another thread only means less halving
+            const int grandparent = parents[parent].load();
+            parents[i].testAndSetRelaxed(parent, grandparent);
+            i = grandparent;
+            parent = parents[i].load();
+        }
+        return i;
+    }
+
+    void unite(int a, int b)
+    {
+        while (true) {
+            a = find(a);
+            b = find(b);
+            if (a == b)
+                return;
+            if (a > b)
+                std::swap(a, b);
+            if (parents[b].testAndSetOrdered(b, a))
+                return;
+        }
+    }
+};
+
+struct DuplicateSearch
+{
+    static const int tile = 1024;
+
+    const TemplateList &templates;
+    const Distance *distance;
+    float threshold;
+    bool symmetric; // Otherwise a pair links if either order scores at least the threshold
+    cv::Mat packed; // Every template as a row, empty if they can't be packed
+    ConcurrentUnionFind sets;
+
+    DuplicateSearch(const TemplateList &templates, const Distance *distance, float threshold)
+        : templates(templates), distance(distance), threshold(threshold), symmetric(distance->symmetric()), sets(templates.size())
+    {
+        if (!distance->batches() || !templates.pack(packed))
+            packed.release();
+    }
+};
+
+// Unite the templates of the tile starting at begin with every later template scoring at least the threshold against them
+static void uniteDuplicates(DuplicateSearch *search, int begin)
+{
+    const TemplateList &templates = search->templates;
+    const int queryEnd = std::min(begin + DuplicateSearch::tile, templates.size());
+
+    for (int j=begin; j<templates.size(); j+=DuplicateSearch::tile) {
+        const int targetEnd = std::min(j + DuplicateSearch::tile, templates.size());
+
+        cv::Mat scores, reversed;
+        const bool batched = !search->packed.empty() &&
+                             search->distance->compareBatch(search->packed.rowRange(j, targetEnd), search->packed.rowRange(begin, queryEnd), scores, search->threshold) &&
+                             (search->symmetric || search->distance->compareBatch(search->packed.rowRange(begin, queryEnd), search->packed.rowRange(j, targetEnd), reversed, search->threshold));
+
+        for (int k=begin; k<queryEnd; k++) {
+            // Within the diagonal tile only the pairs above the diagonal are compared
+            for (int l=std::max(j, k+1); l<targetEnd; l++) {
+                float score;
+                if (batched)                                             score = scores.at<float>(k-begin, l-j);
+                else if (templates[k].isEmpty() || templates[l].isEmpty()) continue;
+                else                                                     score = search->distance->compareBounded(templates[l], templates[k], search->threshold, std::numeric_limits<float>::max());
+
+                if (!search->symmetric && (score < search->threshold)) {
+                    if (batched) score = reversed.at<float>(l-j, k-begin);
+                    else         score = search->distance->compareBounded(templates[k], templates[l], search->threshold, std::numeric_limits<float>::max());
+                }
+
+                if (score >= search->threshold)
+                    search->sets.unite(k, l);
+            }
+        }
+    }
+}
+
+br::Clusters br::ClusterDuplicates(const TemplateList &templates, const Distance *distance, float threshold)
+{
+    DuplicateSearch search(templates, distance, threshold);
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<templates.size(); i+=DuplicateSearch::tile)
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(uniteDuplicates, &search, i));
+        else                      uniteDuplicates(&search, i);
+    futures.waitForFinished();
+
+    // Every set's root is its smallest member, so it is seen before the rest of its set
+    Clusters clusters;
+    QVector<int> clusterOf(templates.size(), -1);
+    for (int i=0; i<templates.size(); i++) {
+        const int root = search.sets.find(i);
+        if (root == i) {
+            clusterOf[i] = clusters.size();
+            clusters.append(Cluster());
+        }
+        clusters[clusterOf[root]].append(i);
+    }
+    return clusters;
+}
+
 br::Clusters br::ReadClusters(const QString &csv)
 {
     Clusters clusters;
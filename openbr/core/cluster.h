@@ -55,6 +55,11 @@ namespace br
     Clusters ClusterSimmat(const QList<cv::Mat> &simmats, float aggressiveness, const QString &csv = "");
     Clusters ClusterSimmat(const QStringList &simmats, float aggressiveness, const QString &csv = "");
 
+    // Group the templates into clusters of duplicates, linked by pairs scoring at least threshold.
+    // Each pair is compared once, in both orders unless the distance is symmetric, in tiles of the upper triangle scored in parallel.
+    // Clusters list their members in increasing order and are ordered by their first member.
+    Clusters ClusterDuplicates(const TemplateList &templates, const Distance *distance, float threshold);
+
     // evaluate clustering results in csv, reading ground truth data from gallery input, using truth_property
     // as the key for ground truth labels.
     void EvalClustering(const QString &csv, const QString &input, QString truth_property);
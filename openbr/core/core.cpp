@@ -14,9 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <openbr/openbr_plugin.h>
 
 #include "bee.h"
+#include "cluster.h"
 #include "common.h"
 #include "qtutils.h"
 #include "../plugins/openbr_internal.h"
@@ -28,6 +31,11 @@ void noDelete(Transform *target)
     (void) target;
 }
 
+void noDelete(Distance *target)
+{
+    (void) target;
+}
+
 struct AlgorithmCore
 {
     enum CompareMode
@@ -41,6 +49,7 @@ struct AlgorithmCore
     QSharedPointer<Transform> simplifiedTransform;
     QSharedPointer<Transform> comparison;
     QSharedPointer<Distance> distance;
+    QSharedPointer<Distance> simplifiedDistance;
     QSharedPointer<Transform> progressCounter;
 
     AlgorithmCore(const QString &name)
@@ -96,6 +105,7 @@ struct AlgorithmCore
         qDebug("Training Time: %s", qPrintable(QtUtils::toTime(Globals->startTime.elapsed()/1000.0f)));
 
         simplifyTransform();
+        simplifyDistance();
     }
 
     void simplifyTransform()
@@ -108,6 +118,25 @@ struct AlgorithmCore
             simplifiedTransform = QSharedPointer<Transform>(temp, noDelete);
     }
 
+    // Comparisons use the simplified distance, which is rebuilt whenever the distance is trained or loaded
+    void simplifyDistance()
+    {
+        if (distance.isNull()) {
+            simplifiedDistance.clear();
+            return;
+        }
+
+        bool newDistance = false;
+        Distance *temp = distance->simplify(newDistance);
+        if (newDistance)
+            simplifiedDistance = QSharedPointer<Distance>(temp);
+        else
+            simplifiedDistance = QSharedPointer<Distance>(temp, noDelete);
+
+        if (comparison)
+            comparison->setPropertyRecursive("distance", QVariant::fromValue(simplifiedDistance.data()));
+    }
+
     void store(const QString &model) const
     {
         QtUtils::BlockCompression compressedWrite;
@@ -163,7 +192,7 @@ struct AlgorithmCore
             distance = QSharedPointer<Distance>(Distance::make(distanceDescription, NULL));
             distance->load(in);
             comparison = QSharedPointer<Transform>(Transform::make("GalleryCompare", NULL));
-            comparison->setPropertyRecursive("distance", QVariant::fromValue(distance.data()));
+            simplifyDistance();
         }
         if (mode == TransformCompare)
             comparison = QSharedPointer<Transform>(Transform::deserialize(in));
@@ -257,7 +286,7 @@ struct AlgorithmCore
 
     void retrieveOrEnroll(const File &file, QScopedPointer<Gallery> &gallery, FileList &galleryFiles)
     {
-        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
+        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "ut" << "ivf").contains(file.suffix())) {
             // Retrieve it
             gallery.reset(Gallery::make(file));
             galleryFiles = gallery->files();
@@ -284,82 +313,130 @@ struct AlgorithmCore
 
         if (queryGallery == ".") queryGallery = targetGallery;
 
-        QScopedPointer<Gallery> t, q;
-        FileList targetFiles, queryFiles;
-        retrieveOrEnroll(targetGallery, t, targetFiles);
-        retrieveOrEnroll(queryGallery, q, queryFiles);
-
-        if (t->files().length() != q->files().length() )
+        // Only the metadata is read up front, the templates are read, enrolled and compared a block at a time
+        const FileList targetFiles = FileList::fromGallery(targetGallery, true);
+        const FileList queryFiles = FileList::fromGallery(queryGallery, true);
+        if (targetFiles.size() != queryFiles.size())
             qFatal("Dimension mismatch in pairwise compare");
-
-        TemplateList queries = q->read();
-        TemplateList targets = t->read();
+        if (queryFiles.isEmpty())
+            return;
 
         output.set("targetGallery", targetGallery.name );
         output.set("queryGallery", queryGallery.name );
 
         // Use a single file for one of the dimensions so that the output makes the right size file
         FileList dummyTarget;
-        dummyTarget.append(targets[0]);
+        dummyTarget.append(targetFiles.first());
         QScopedPointer<Output> realOutput(Output::make(output, dummyTarget, queryFiles));
 
         realOutput->set_blockRows(INT_MAX);
         realOutput->set_blockCols(INT_MAX);
         realOutput->setBlock(0,0);
-        for (int i=0; i < queries.length(); i++) {
-            float res = distance->compare(queries[i], targets[i]);
-            realOutput->setRelative(res, 0,i);
+
+        QScopedPointer<Gallery> t(Gallery::make(targetGallery)), q(Gallery::make(queryGallery));
+        const bool enrollTargets = needsEnrollment(targetGallery), enrollQueries = needsEnrollment(queryGallery);
+
+        // The galleries may return blocks of different sizes, so whatever is read past the aligned pairs waits for the next block
+        TemplateList targets, queries;
+        bool targetsDone = false, queriesDone = false;
+        int compared = 0;
+        while (true) {
+            if (!targetsDone && (queriesDone || (targets.size() <= queries.size())))
+                targets.append(readPairs(t.data(), enrollTargets, &targetsDone));
+            if (!queriesDone && (targetsDone || (queries.size() <= targets.size())))
+                queries.append(readPairs(q.data(), enrollQueries, &queriesDone));
+
+            const int size = std::min(targets.size(), queries.size());
+            comparePairs(targets.mid(0, size), queries.mid(0, size), realOutput.data(), compared);
+            targets.erase(targets.begin(), targets.begin() + size);
+            queries.erase(queries.begin(), queries.begin() + size);
+            compared += size;
+
+            if (targetsDone && queriesDone)
+                break;
         }
+
+        if (!targets.isEmpty() || !queries.isEmpty())
+            qFatal("Dimension mismatch in pairwise compare");
     }
 
-    void deduplicate(const File &inputGallery, const File &outputGallery, const float threshold)
+    static bool needsEnrollment(const File &file)
     {
-        qDebug("Deduplicating %s to %s with a score threshold of %f", qPrintable(inputGallery.flat()), qPrintable(outputGallery.flat()), threshold);
-
-        if (distance.isNull()) qFatal("Null distance.");
-
-        QScopedPointer<Gallery> i;
-        FileList inputFiles;
-        retrieveOrEnroll(inputGallery, i, inputFiles);
-
-        TemplateList t = i->read();
-
-        Output *o = Output::make(QString("buffer.tail[selfSimilar,threshold=%1,atLeast=0]").arg(QString::number(threshold)),inputFiles,inputFiles);
-
-        // Compare to global tail output
-        distance->compare(t,t,o);
+        return file.getBool("enroll") || !(QStringList() << "gal" << "mem" << "template" << "ut" << "ivf").contains(file.suffix());
+    }
 
-        delete o;
+    // Pairs are aligned by position, so enrollment must produce exactly one template per input.
+    // Otherwise every later pair would be misaligned, and this is caught before any of them are scored.
+    TemplateList readPairs(Gallery *gallery, bool enrollBlock, bool *done) const
+    {
+        TemplateList block = gallery->readBlock(done);
+        if (enrollBlock && !block.isEmpty()) {
+            const int size = block.size();
+            block >> *simplifiedTransform;
+            if (block.size() != size)
+                qFatal("Dimension mismatch in pairwise compare, enrolling %d templates produced %d.", size, block.size());
+        }
+        return block;
+    }
 
-        QString buffer(Globals->buffer);
+    static void scorePairs(const Distance *distance, const TemplateList &targets, const TemplateList &queries, float *scores)
+    {
+        for (int i=0; i<queries.size(); i++)
+            scores[i] = distance->compare(queries[i], targets[i]);
+    }
 
-        QStringList tail = buffer.split("\n");
+    // Score a block of aligned pairs in parallel, then write the scores in order to the output
+    void comparePairs(const TemplateList &targets, const TemplateList &queries, Output *output, int offset) const
+    {
+        if (queries.isEmpty())
+            return;
 
-        // Remove header
-        tail.removeFirst();
+        QVector<float> scores(queries.size());
+        const int stepSize = ceil(float(queries.size()) / float(std::max(1, abs(Globals->parallelism))));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<queries.size(); i+=stepSize) {
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(&AlgorithmCore::scorePairs, (const Distance*) simplifiedDistance.data(), targets.mid(i, stepSize), queries.mid(i, stepSize), scores.data() + i));
+            else                      scorePairs(simplifiedDistance.data(), targets.mid(i, stepSize), queries.mid(i, stepSize), scores.data() + i);
+        }
+        futures.waitForFinished();
 
-        QStringList toRemove;
-        foreach (const QString &s, tail)
-            toRemove.append(s.split(',').at(1));
+        for (int i=0; i<scores.size(); i++)
+            output->setRelative(scores[i], 0, offset+i);
+    }
 
-        QSet<QString> duplicates = QSet<QString>::fromList(toRemove);
+    void deduplicate(const File &inputGallery, const File &outputGallery, const float threshold)
+    {
+        qDebug("Deduplicating %s to %s with a score threshold of %f", qPrintable(inputGallery.flat()), qPrintable(outputGallery.flat()), threshold);
 
-        QStringList fileNames = inputFiles.names();
+        if (distance.isNull()) qFatal("Null distance.");
 
-        QList<int> indices;
-        foreach (const QString &d, duplicates)
-            indices.append(fileNames.indexOf(d));
+        QScopedPointer<Gallery> i;
+        FileList inputFiles;
+        retrieveOrEnroll(inputGallery, i, inputFiles);
 
-        std::sort(indices.begin(),indices.end(),std::greater<float>());
+        const TemplateList t = i->read();
+        const Clusters clusters = ClusterDuplicates(t, simplifiedDistance.data(), threshold);
+
+        // Each cluster is kept as its last template, which lists the rest of the cluster as its duplicates
+        QMap<int, File> kept;
+        foreach (const Cluster &cluster, clusters) {
+            File representative = inputFiles[cluster.last()];
+            QStringList duplicates;
+            for (int j=0; j<cluster.size()-1; j++)
+                duplicates.append(inputFiles[cluster[j]].name);
+            if (!duplicates.isEmpty())
+                representative.set("Duplicates", duplicates);
+            kept.insert(cluster.last(), representative);
+        }
 
-        qDebug("\n%d duplicates removed.", indices.size());
+        // Keep the gallery order
+        const FileList representatives = kept.values();
 
-        for (int i=0; i<indices.size(); i++)
-            inputFiles.removeAt(indices[i]);
+        qDebug("\n%d duplicates removed.", t.size() - representatives.size());
 
         QScopedPointer<Gallery> og(Gallery::make(outputGallery));
 
-        og->writeBlock(inputFiles);
+        og->writeBlock(representatives);
     }
 
     void compare(File targetGallery, File queryGallery, File output)
@@ -390,6 +467,12 @@ struct AlgorithmCore
         if (output.exists() && output.get<bool>("cache", false)) return;
         if (queryGallery == ".") queryGallery = targetGallery;
 
+        // A target gallery of several shards with the "sharded" argument is searched shard by shard instead of as one gallery
+        if (!selfCompare && distance && targetGallery.getBool("sharded") && (targetGallery.split().size() > 1)) {
+            compareShards(targetGallery, queryGallery, output);
+            return;
+        }
+
         // To decide which gallery is larger, we need to read both, but at this point we just want the
         // metadata, and don't need the enrolled matrices.
         FileList targetMetadata;
@@ -402,6 +485,14 @@ struct AlgorithmCore
         // Is the target or query set larger? We will use the larger as the rows of our comparison matrix (and transpose the output if necessary)
         transposeMode = targetMetadata.size() > queryMetadata.size();
 
+        // Searching an inverted file index keeps the index in memory as the columns, regardless of its size.
+        const bool indexSearch = !selfCompare && distance && (targetGallery.suffix() == "ivf");
+
+        // So does searching an 8-bit quantized copy of the target gallery, requested with the "quantize" gallery argument.
+        const bool quantizedSearch = !indexSearch && !selfCompare && distance && targetGallery.getBool("quantize");
+        if (indexSearch || quantizedSearch)
+            transposeMode = false;
+
         File rowGallery = queryGallery;
         File colGallery = targetGallery;
         qint64 rowSize;
@@ -429,12 +520,12 @@ struct AlgorithmCore
         QString targetExtension = "mem";
 
         // If the column gallery is not already of the appropriate type, we need to do something
-        if (colGallery.suffix() != targetExtension) {
+        if (!indexSearch && (colGallery.suffix() != targetExtension)) {
             // Build the name of a gallery containing the enrolled data, of the appropriate type.
             colEnrolledGallery = colGallery.baseName() + colGallery.hash() + '.' + targetExtension;
 
             // Check if we have to do real enrollment, and not just convert the gallery's type.
-            if (!(QStringList() << "gal" << "template" << "mem" << "ut").contains(colGallery.suffix()))
+            if (!(QStringList() << "gal" << "template" << "mem" << "ut" << "ivf").contains(colGallery.suffix()))
                 enroll(colGallery, colEnrolledGallery);
 
             // If the gallery does have enrolled templates, but is not the right type, we do a simple
@@ -447,6 +538,12 @@ struct AlgorithmCore
             }
         }
 
+        // Self-comparisons with a symmetric distance score each pair only once, see compareSymmetric().
+        if (selfCompare && distance && simplifiedDistance->symmetric() && !multiProcess) {
+            compareSymmetric(TemplateList::fromGallery(colEnrolledGallery), targetGallery, output);
+            return;
+        }
+
         // We have handled the column gallery, now decide whehter or not we have to enroll the row gallery.
         if (selfCompare) {
             // For self-comparisons, we just use the already enrolled column set.
@@ -456,7 +553,7 @@ struct AlgorithmCore
         // which compares incoming templates against a gallery, we will handle enrollment of the row set by simply
         // building a transform that does enrollment (using the current algorithm), then does the comparison in one
         // step. This way, we don't have to retain the complete enrolled row gallery in memory, or on disk.
-        else if (!(QStringList() << "gal" << "mem" << "template" << "ut").contains(rowGallery.suffix()))
+        else if (!(QStringList() << "gal" << "mem" << "template" << "ut" << "ivf").contains(rowGallery.suffix()))
             needEnrollRows = true;
 
         // At this point, we have decided how we will structure the comparison (either in transpose mode, or not), 
@@ -472,13 +569,35 @@ struct AlgorithmCore
         // The actual comparison step is done by a GalleryCompare transform, which has a Distance, and a gallery as data.
         // Incoming templates are compared against the templates in the gallery, and the output is the resulting score
         // vector.
-        TemplateList tlist = TemplateList::fromGallery(colEnrolledGallery);
-        comparison->train(tlist);
-        comparison->setPropertyRecursive("galleryName","");
+        //
+        // Against an inverted file index the comparison is instead done by an IVFCompare transform, which only scores the
+        // gallery templates near each incoming template, using the same distance.
+        //
+        // Against a quantized gallery it is done by a QuantizedCompare transform, which scores every gallery template
+        // approximately and only the best "rerank" of them exactly.
+        QSharedPointer<Transform> search = comparison;
+        if (indexSearch) {
+            search = QSharedPointer<Transform>(Transform::make("IVFCompare", NULL));
+            search->setPropertyRecursive("distance", QVariant::fromValue(simplifiedDistance.data()));
+            search->setPropertyRecursive("nprobe", targetGallery.get<int>("nprobe", 8));
+            search->setPropertyRecursive("recall", targetGallery.get<int>("recall", 0));
+            search->setPropertyRecursive("galleryName", colGallery.name);
+            search->init();
+        } else if (quantizedSearch) {
+            search = QSharedPointer<Transform>(Transform::make("QuantizedCompare", NULL));
+            search->setPropertyRecursive("distance", QVariant::fromValue(simplifiedDistance.data()));
+            search->setPropertyRecursive("rerank", targetGallery.get<int>("rerank", 100));
+            search->setPropertyRecursive("galleryName", colEnrolledGallery.flat());
+            search->init();
+        } else {
+            TemplateList tlist = TemplateList::fromGallery(colEnrolledGallery);
+            comparison->train(tlist);
+            comparison->setPropertyRecursive("galleryName","");
+        }
 
         QString compareRegionDesc;
         QList<Transform *> enrollCompare;
-        enrollCompare.append(comparison.data());
+        enrollCompare.append(search.data());
 
         // if we have to enroll the row gallery, add that transform to the list
         if (needEnrollRows)
@@ -528,6 +647,186 @@ struct AlgorithmCore
         streamWrapper->projectUpdate(rowGalleryTemplate, outputGallery);
     }
 
+    // Compare a gallery against itself one band of rows of the upper triangle at a time, writing each tile of the band
+    // and its mirror image below the diagonal to the output.
+    void compareSymmetric(const TemplateList &templates, const File &gallery, const File &output)
+    {
+        // The output is written in square blocks of one tile, bands are narrowed to hold at most 2^26 scores
+        const int band = std::max(16, std::min(256, (1 << 26) / std::max(1, templates.size())));
+
+        const FileList files = templates.files();
+        QVector<bool> fte(templates.size());
+        for (int i=0; i<templates.size(); i++)
+            fte[i] = templates[i].file.getBool("FTE") || templates[i].file.fte;
+
+        // The band is passed as a parameter so every output in the chain is initialized once with it
+        File outputFile = output.flat().isEmpty() ? File("Empty") : output;
+        outputFile.set("targetGallery", gallery.flat());
+        outputFile.set("queryGallery", gallery.flat());
+        outputFile.set("blockRows", band);
+        outputFile.set("blockCols", band);
+        QScopedPointer<Output> realOutput(Output::make(outputFile, files, files));
+
+        progressCounter->setPropertyRecursive("totalProgress", QString::number(templates.size()));
+        progressCounter->init();
+
+        for (int i=0; i<templates.size(); i+=band) {
+            const TemplateList rows = templates.mid(i, band);
+            const TemplateList columns = templates.mid(i);
+            QScopedPointer<MatrixOutput> scores(MatrixOutput::make(columns.files(), rows.files()));
+            simplifiedDistance->compare(columns, rows, scores.data());
+
+            for (int j=i; j<templates.size(); j+=band) {
+                const cv::Mat tile = scores->data.colRange(j-i, std::min(j+band, templates.size())-i);
+
+                realOutput->setBlock(i/band, j/band);
+                for (int k=0; k<tile.rows; k++)
+                    for (int l=0; l<tile.cols; l++)
+                        realOutput->setRelative((fte[i+k] || fte[j+l]) ? -std::numeric_limits<float>::max() : tile.at<float>(k, l), k, l);
+
+                if (j == i)
+                    continue;
+
+                realOutput->setBlock(j/band, i/band);
+                for (int k=0; k<tile.cols; k++)
+                    for (int l=0; l<tile.rows; l++)
+                        realOutput->setRelative((fte[j+k] || fte[i+l]) ? -std::numeric_limits<float>::max() : tile.at<float>(l, k), k, l);
+            }
+
+            TemplateList done = rows, unused;
+            for (int k=0; k<done.size(); k++)
+                done[k].file.set("progress", i+k);
+            progressCounter->projectUpdate(done, unused);
+        }
+
+        TemplateList unused;
+        progressCounter->finalize(unused);
+    }
+
+    // A candidate match of a sharded search, by its column among the concatenated shards
+    struct ShardMatch
+    {
+        float score;
+        int column;
+
+        ShardMatch(float score = 0, int column = 0) : score(score), column(column) {}
+        bool operator<(const ShardMatch &other) const { return (score > other.score) || ((score == other.score) && (column < other.column)); }
+    };
+    typedef QVector<ShardMatch> ShardMatches;
+
+    static void keepBest(ShardMatches &matches, int topK)
+    {
+        const int size = std::min(topK, matches.size());
+        std::partial_sort(matches.begin(), matches.begin() + size, matches.end());
+        matches.resize(size);
+    }
+
+    // Load a shard and keep the topK best matches of each query in it
+    static QVector<ShardMatches> searchShard(const Distance *distance, const File &shard, const TemplateList &queries, int offset, int topK)
+    {
+        // Queries are scored a block at a time so that only a block of the score matrix is held at once
+        static const int queryBlock = 256;
+
+        const TemplateList targets = TemplateList::fromGallery(shard);
+        const FileList targetFiles = targets.files();
+
+        QVector<ShardMatches> best(queries.size());
+        for (int i=0; i<queries.size(); i+=queryBlock) {
+            const TemplateList block = queries.mid(i, queryBlock);
+            QScopedPointer<MatrixOutput> scores(MatrixOutput::make(targetFiles, block.files()));
+            distance->compare(targets, block, scores.data());
+
+            for (int k=0; k<block.size(); k++) {
+                const float *score = scores->data.ptr<float>(k);
+                ShardMatches &matches = best[i+k];
+                for (int j=0; j<targets.size(); j++)
+                    if (score[j] != -std::numeric_limits<float>::max())
+                        matches.append(ShardMatch(score[j], offset+j));
+                keepBest(matches, topK);
+            }
+        }
+        return best;
+    }
+
+    // Search the shards of the target gallery concurrently, as many at a time as fit in the "shardMemory" budget (in megabytes, 1024 by default),
+    // merging the "topK" best matches of each query as each shard finishes. Every other score is the lowest representable value,
+    // as are the scores of queries that failed to enroll, as OutputTransform writes them.
+    void compareShards(const File &targetGallery, const File &queryGallery, File output)
+    {
+        const int topK = targetGallery.get<int>("topK", 100);
+        const qint64 budget = qint64(targetGallery.get<int>("shardMemory", 1024)) * 1024 * 1024;
+        if (topK < 1) qFatal("Sharded search requires a positive topK.");
+        if (budget < 1) qFatal("Sharded search requires a positive shardMemory.");
+
+        // The queries are enrolled once and held in memory for every shard
+        QScopedPointer<Gallery> q;
+        FileList queryFiles;
+        retrieveOrEnroll(queryGallery, q, queryFiles);
+        const TemplateList queries = q->read();
+
+        // The shards are only enrolled up front, to disk, and loaded when searched
+        QList<File> shards;
+        QList<int> offsets;
+        QList<qint64> sizes;
+        FileList targetFiles;
+        foreach (const File &shard, targetGallery.split()) {
+            File enrolled = shard;
+            if (!(QStringList() << "gal" << "mem" << "template" << "ut").contains(shard.suffix())) {
+                enrolled = shard.baseName() + shard.hash() + ".gal";
+                enroll(shard, enrolled);
+            }
+
+            shards.append(enrolled);
+            offsets.append(targetFiles.size());
+            targetFiles.append(FileList::fromGallery(enrolled, true));
+
+            // Memory galleries are already resident and don't count against the budget
+            sizes.append(QFileInfo(enrolled.name).size());
+        }
+
+        QVector<ShardMatches> best(queries.size());
+        for (int begin=0; begin<shards.size();) {
+            int end = begin + 1;
+            qint64 resident = sizes[begin];
+            while ((end < shards.size()) && (resident + sizes[end] <= budget))
+                resident += sizes[end++];
+
+            qDebug("Searching shards %d-%d of %d", begin+1, end, shards.size());
+            QList< QFuture< QVector<ShardMatches> > > futures;
+            for (int i=begin; i<end; i++)
+                futures.append(QtConcurrent::run(&AlgorithmCore::searchShard, (const Distance*) simplifiedDistance.data(), shards[i], queries, offsets[i], topK));
+
+            // Merge each shard into the best matches so far as soon as it is searched
+            for (int i=0; i<futures.size(); i++) {
+                const QVector<ShardMatches> matches = futures[i].result();
+                for (int j=0; j<queries.size(); j++) {
+                    best[j] += matches[j];
+                    keepBest(best[j], topK);
+                }
+            }
+
+            begin = end;
+        }
+
+        output.set("targetGallery", targetGallery.name);
+        output.set("queryGallery", queryGallery.name);
+        QScopedPointer<Output> realOutput(Output::make(output, targetFiles, queries.files()));
+        realOutput->set_blockRows(INT_MAX);
+        realOutput->set_blockCols(INT_MAX);
+        realOutput->setBlock(0, 0);
+
+        QVector<float> row(targetFiles.size());
+        for (int i=0; i<queries.size(); i++) {
+            row.fill(-std::numeric_limits<float>::max());
+            const bool fte = queries[i].file.getBool("FTE") || queries[i].file.fte;
+            if (!fte)
+                foreach (const ShardMatch &match, best[i])
+                    row[match.column] = match.score;
+            for (int j=0; j<row.size(); j++)
+                realOutput->setRelative(row[j], i, j);
+        }
+    }
+
 private:
     QString name;
 
@@ -581,7 +880,7 @@ private:
             if (!compareTransform) {
                 distance = QSharedPointer<Distance>(Distance::make(words[1], NULL));
                 comparison = QSharedPointer<Transform>(Transform::make("GalleryCompare", NULL));
-                comparison->setPropertyRecursive("distance", QVariant::fromValue(distance.data()));
+                simplifyDistance();
             }
             else
                 comparison = QSharedPointer<Transform>(Transform::make(words[1], NULL));
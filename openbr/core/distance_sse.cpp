@@ -0,0 +1,779 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance_sse.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif // x86
+
+// Kernels are compiled for their instruction set regardless of the global compiler flags,
+// and only called when the CPU reports support for it.
+#ifdef __GNUC__
+#define BR_TARGET(ISA) __attribute__((target(ISA)))
+#else
+#define BR_TARGET(ISA)
+#endif
+
+typedef float (*L1Kernel)(const uchar *a, const uchar *b, int size);
+typedef float (*LookupKernel)(const float *tables, const uchar *codes, int size);
+typedef qint64 (*DotKernel)(const short *weights, const uchar *codes, int size);
+typedef float (*HalfKernel)(const ushort *a, const ushort *b, int size);
+typedef float (*HammingKernel)(const uchar *a, const uchar *b, int size);
+typedef void (*ToHalfKernel)(const float *src, ushort *dst, int size);
+typedef void (*FromHalfKernel)(const ushort *src, float *dst, int size);
+
+// IEEE 754 binary16 conversions, rounding to the nearest even value
+static inline float halfToFloat(ushort h)
+{
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+
+    uint32_t bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13); // Infinity or NaN
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // Subnormal halves are normal floats
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline ushort floatToHalf(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const uint32_t absolute = bits & 0x7FFFFFFF;
+
+    if (absolute >= 0x7F800000) // Infinity or NaN
+        return sign | 0x7C00 | ((absolute > 0x7F800000) ? 0x200 : 0);
+    if (absolute >= 0x477FF000) // Rounds past the largest half
+        return sign | 0x7C00;
+
+    if (absolute < 0x38800000) {
+        // Subnormal half, in units of 2^-24
+        if (absolute <= 0x33000000)
+            return sign;
+        const uint32_t mantissa = (absolute & 0x7FFFFF) | 0x800000;
+        const int shift = 126 - int(absolute >> 23);
+        uint32_t result = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if ((remainder > halfway) || ((remainder == halfway) && (result & 1)))
+            result++;
+        return sign | result;
+    }
+
+    // Rebias the exponent and round the mantissa to 10 bits, a carry correctly increments the exponent
+    uint32_t result = (absolute - 0x38000000) >> 13;
+    const uint32_t remainder = absolute & 0x1FFF;
+    if ((remainder > 0x1000) || ((remainder == 0x1000) && (result & 1)))
+        result++;
+    return sign | result;
+}
+
+static inline int l1Tail(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs(a[i]-b[i]);
+    return distance;
+}
+
+static inline int packedL1Tail(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs((a[i] & 0x0F) - (b[i] & 0x0F)) +
+                    abs((a[i] >> 4)   - (b[i] >> 4));
+    return distance;
+}
+
+static inline float lookupTail(const float *tables, const uchar *codes, int size)
+{
+    float sum = 0;
+    for (int i=0; i<size; i++)
+        sum += tables[i*256 + codes[i]];
+    return sum;
+}
+
+static inline qint64 dotTail(const short *weights, const uchar *codes, int size)
+{
+    qint64 sum = 0;
+    for (int i=0; i<size; i++)
+        sum += weights[i] * codes[i];
+    return sum;
+}
+
+static inline int popcount64(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return int((x * 0x0101010101010101ULL) >> 56);
+}
+
+static inline int hammingTail(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += popcount64(a[i] ^ b[i]);
+    return distance;
+}
+
+static float hammingScalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        uint64_t A, B;
+        memcpy(&A, a+i, sizeof(A));
+        memcpy(&B, b+i, sizeof(B));
+        distance += popcount64(A ^ B);
+    }
+    return distance + hammingTail(a+i, b+i, size-i);
+}
+
+static void toHalfScalar(const float *src, ushort *dst, int size)
+{
+    for (int i=0; i<size; i++)
+        dst[i] = floatToHalf(src[i]);
+}
+
+static void fromHalfScalar(const ushort *src, float *dst, int size)
+{
+    for (int i=0; i<size; i++)
+        dst[i] = halfToFloat(src[i]);
+}
+
+static inline float l1HalfTail(const ushort *a, const ushort *b, int size)
+{
+    float distance = 0;
+    for (int i=0; i<size; i++)
+        distance += std::abs(halfToFloat(a[i]) - halfToFloat(b[i]));
+    return distance;
+}
+
+static inline float l2HalfTail(const ushort *a, const ushort *b, int size)
+{
+    float distance = 0;
+    for (int i=0; i<size; i++) {
+        const float difference = halfToFloat(a[i]) - halfToFloat(b[i]);
+        distance += difference * difference;
+    }
+    return distance;
+}
+
+static inline float dotHalfTail(const ushort *a, const ushort *b, int size)
+{
+    float dot = 0;
+    for (int i=0; i<size; i++)
+        dot += halfToFloat(a[i]) * halfToFloat(b[i]);
+    return dot;
+}
+
+static float l1Scalar(const uchar *a, const uchar *b, int size)
+{
+    return l1Tail(a, b, size);
+}
+
+static float packedL1Scalar(const uchar *a, const uchar *b, int size)
+{
+    return packedL1Tail(a, b, size);
+}
+
+static float lookupScalar(const float *tables, const uchar *codes, int size)
+{
+    return lookupTail(tables, codes, size);
+}
+
+#ifdef BR_X86
+
+/**** SSE2 ****/
+BR_TARGET("sse2")
+static float l1SSE2(const uchar *a, const uchar *b, int size)
+{
+    __m128i accumulate = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i));
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(A, B));
+    }
+
+    int64_t buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1] + l1Tail(a+i, b+i, size-i);
+}
+
+BR_TARGET("sse2")
+static float packedL1SSE2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i lowMask = _mm_set1_epi8(0x0F);
+    __m128i accumulate = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i));
+
+        // Unpack the nibbles into two vectors of 8-bit values
+        const __m128i lowA = _mm_and_si128(A, lowMask), highA = _mm_and_si128(_mm_srli_epi16(A, 4), lowMask);
+        const __m128i lowB = _mm_and_si128(B, lowMask), highB = _mm_and_si128(_mm_srli_epi16(B, 4), lowMask);
+        accumulate = _mm_add_epi64(accumulate, _mm_add_epi64(_mm_sad_epu8(lowA, lowB), _mm_sad_epu8(highA, highB)));
+    }
+
+    int64_t buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1] + packedL1Tail(a+i, b+i, size-i);
+}
+
+// Codes widened to 16 bits, multiplied by the weights and summed in adjacent pairs
+BR_TARGET("sse2")
+static qint64 dotSSE2(const short *weights, const uchar *codes, int size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i accumulate = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i C = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes+i));
+        const __m128i lowW = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights+i));
+        const __m128i highW = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights+i+8));
+        accumulate = _mm_add_epi32(accumulate, _mm_madd_epi16(_mm_unpacklo_epi8(C, zero), lowW));
+        accumulate = _mm_add_epi32(accumulate, _mm_madd_epi16(_mm_unpackhi_epi8(C, zero), highW));
+    }
+
+    int32_t buff[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return qint64(buff[0]) + buff[1] + buff[2] + buff[3] + dotTail(weights+i, codes+i, size-i);
+}
+
+/**** POPCNT ****/
+BR_TARGET("popcnt")
+static float hammingPOPCNT(const uchar *a, const uchar *b, int size)
+{
+    int64_t distance = 0;
+    int i = 0;
+#if defined(__x86_64__) || defined(_M_X64)
+    for (; i+8<=size; i+=8) {
+        uint64_t A, B;
+        memcpy(&A, a+i, sizeof(A));
+        memcpy(&B, b+i, sizeof(B));
+        distance += _mm_popcnt_u64(A ^ B);
+    }
+#else
+    for (; i+4<=size; i+=4) {
+        uint32_t A, B;
+        memcpy(&A, a+i, sizeof(A));
+        memcpy(&B, b+i, sizeof(B));
+        distance += _mm_popcnt_u32(A ^ B);
+    }
+#endif
+    return distance + hammingTail(a+i, b+i, size-i);
+}
+
+/**** AVX2 ****/
+BR_TARGET("avx2")
+static float l1AVX2(const uchar *a, const uchar *b, int size)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(A, B));
+    }
+
+    int64_t buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + l1Tail(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float packedL1AVX2(const uchar *a, const uchar *b, int size)
+{
+    const __m256i lowMask = _mm256_set1_epi8(0x0F);
+    __m256i accumulate = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i));
+
+        const __m256i lowA = _mm256_and_si256(A, lowMask), highA = _mm256_and_si256(_mm256_srli_epi16(A, 4), lowMask);
+        const __m256i lowB = _mm256_and_si256(B, lowMask), highB = _mm256_and_si256(_mm256_srli_epi16(B, 4), lowMask);
+        accumulate = _mm256_add_epi64(accumulate, _mm256_add_epi64(_mm256_sad_epu8(lowA, lowB), _mm256_sad_epu8(highA, highB)));
+    }
+
+    int64_t buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + packedL1Tail(a+i, b+i, size-i);
+}
+
+// Eight codes at a time, each offset into its own table
+BR_TARGET("avx2")
+static float lookupAVX2(const float *tables, const uchar *codes, int size)
+{
+    const __m256i stride = _mm256_set1_epi32(8*256);
+    __m256i offsets = _mm256_setr_epi32(0, 256, 2*256, 3*256, 4*256, 5*256, 6*256, 7*256);
+    __m256 accumulate = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        const __m256i C = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes+i)));
+        accumulate = _mm256_add_ps(accumulate, _mm256_i32gather_ps(tables, _mm256_add_epi32(offsets, C), 4));
+        offsets = _mm256_add_epi32(offsets, stride);
+    }
+
+    float buff[8];
+    _mm256_storeu_ps(buff, accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7] + lookupTail(tables+i*256, codes+i, size-i);
+}
+
+// Bits counted a nibble at a time with a shuffle as a 16-entry table, then summed per 8 bytes
+BR_TARGET("avx2")
+static float hammingAVX2(const uchar *a, const uchar *b, int size)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i accumulate = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i));
+        const __m256i X = _mm256_xor_si256(A, B);
+        const __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(X, lowMask)),
+                                               _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(X, 4), lowMask)));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(counts, zero));
+    }
+
+    int64_t buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + hammingScalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static qint64 dotAVX2(const short *weights, const uchar *codes, int size)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m256i C = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(codes+i)));
+        const __m256i W = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights+i));
+        accumulate = _mm256_add_epi32(accumulate, _mm256_madd_epi16(C, W));
+    }
+
+    int32_t buff[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    qint64 sum = 0;
+    for (int j=0; j<8; j++)
+        sum += buff[j];
+    return sum + dotTail(weights+i, codes+i, size-i);
+}
+
+/**** F16C ****/
+// Halves are widened eight at a time and accumulated in single precision
+BR_TARGET("avx,f16c")
+static void toHalfF16C(const float *src, ushort *dst, int size)
+{
+    int i = 0;
+    for (; i+8<=size; i+=8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), _MM_FROUND_TO_NEAREST_INT));
+    toHalfScalar(src+i, dst+i, size-i);
+}
+
+BR_TARGET("avx,f16c")
+static void fromHalfF16C(const ushort *src, float *dst, int size)
+{
+    int i = 0;
+    for (; i+8<=size; i+=8)
+        _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i))));
+    fromHalfScalar(src+i, dst+i, size-i);
+}
+
+BR_TARGET("avx")
+static inline float sum(__m256 v)
+{
+    float buff[8];
+    _mm256_storeu_ps(buff, v);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7];
+}
+
+BR_TARGET("avx,f16c")
+static float l1HalfF16C(const ushort *a, const ushort *b, int size)
+{
+    const __m256 signMask = _mm256_set1_ps(-0.f);
+    __m256 accumulate = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        const __m256 A = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)));
+        const __m256 B = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i)));
+        accumulate = _mm256_add_ps(accumulate, _mm256_andnot_ps(signMask, _mm256_sub_ps(A, B)));
+    }
+
+    return sum(accumulate) + l1HalfTail(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx,f16c")
+static float l2HalfF16C(const ushort *a, const ushort *b, int size)
+{
+    __m256 accumulate = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        const __m256 A = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)));
+        const __m256 B = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i)));
+        const __m256 difference = _mm256_sub_ps(A, B);
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(difference, difference));
+    }
+
+    return sum(accumulate) + l2HalfTail(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx,f16c")
+static float dotHalfF16C(const ushort *a, const ushort *b, int size)
+{
+    __m256 accumulate = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        const __m256 A = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)));
+        const __m256 B = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i)));
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(A, B));
+    }
+
+    return sum(accumulate) + dotHalfTail(a+i, b+i, size-i);
+}
+
+/**** AVX-512F ****/
+BR_TARGET("avx512f")
+static float lookupAVX512(const float *tables, const uchar *codes, int size)
+{
+    // The masked forms with every lane enabled, as the unmasked ones read an undefined source register
+    const __mmask16 all = 0xFFFF;
+    const __m512i stride = _mm512_set1_epi32(16*256);
+    __m512i offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(256));
+    __m512 accumulate = _mm512_setzero_ps();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m512i C = _mm512_maskz_cvtepu8_epi32(all, _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes+i)));
+        accumulate = _mm512_add_ps(accumulate, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), all, _mm512_add_epi32(offsets, C), tables, 4));
+        offsets = _mm512_add_epi32(offsets, stride);
+    }
+
+    float buff[16];
+    _mm512_storeu_ps(buff, accumulate);
+    float sum = 0;
+    for (int j=0; j<16; j++)
+        sum += buff[j];
+    return sum + lookupTail(tables+i*256, codes+i, size-i);
+}
+
+/**** AVX-512BW ****/
+// The tail is handled with a masked load, which never touches the bytes past the end of the vectors.
+static inline __mmask64 tailMask(int remaining)
+{
+    return remaining >= 64 ? ~__mmask64(0) : (__mmask64(1) << remaining) - 1;
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float l1AVX512(const uchar *a, const uchar *b, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+
+    for (int i=0; i<size; i+=64) {
+        const __mmask64 mask = tailMask(size-i);
+        const __m512i A = _mm512_maskz_loadu_epi8(mask, a+i);
+        const __m512i B = _mm512_maskz_loadu_epi8(mask, b+i);
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(A, B));
+    }
+
+    int64_t buff[8];
+    _mm512_storeu_si512(buff, accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7];
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float packedL1AVX512(const uchar *a, const uchar *b, int size)
+{
+    const __m512i lowMask = _mm512_set1_epi8(0x0F);
+    __m512i accumulate = _mm512_setzero_si512();
+
+    for (int i=0; i<size; i+=64) {
+        const __mmask64 mask = tailMask(size-i);
+        const __m512i A = _mm512_maskz_loadu_epi8(mask, a+i);
+        const __m512i B = _mm512_maskz_loadu_epi8(mask, b+i);
+
+        const __m512i lowA = _mm512_and_si512(A, lowMask), highA = _mm512_and_si512(_mm512_srli_epi16(A, 4), lowMask);
+        const __m512i lowB = _mm512_and_si512(B, lowMask), highB = _mm512_and_si512(_mm512_srli_epi16(B, 4), lowMask);
+        accumulate = _mm512_add_epi64(accumulate, _mm512_add_epi64(_mm512_sad_epu8(lowA, lowB), _mm512_sad_epu8(highA, highB)));
+    }
+
+    int64_t buff[8];
+    _mm512_storeu_si512(buff, accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7];
+}
+
+BR_TARGET("avx512f,avx512bw")
+static qint64 dotAVX512(const short *weights, const uchar *codes, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m512i C = _mm512_maskz_cvtepu8_epi16(~__mmask32(0), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes+i)));
+        const __m512i W = _mm512_loadu_si512(weights+i);
+        accumulate = _mm512_add_epi32(accumulate, _mm512_madd_epi16(C, W));
+    }
+
+    int32_t buff[16];
+    _mm512_storeu_si512(buff, accumulate);
+    qint64 sum = 0;
+    for (int j=0; j<16; j++)
+        sum += buff[j];
+    return sum + dotTail(weights+i, codes+i, size-i);
+}
+
+/**** AVX-512 VPOPCNTDQ ****/
+BR_TARGET("avx512f,avx512bw,avx512vpopcntdq")
+static float hammingAVX512(const uchar *a, const uchar *b, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+
+    for (int i=0; i<size; i+=64) {
+        const __mmask64 mask = tailMask(size-i);
+        const __m512i A = _mm512_maskz_loadu_epi8(mask, a+i);
+        const __m512i B = _mm512_maskz_loadu_epi8(mask, b+i);
+        accumulate = _mm512_add_epi64(accumulate, _mm512_popcnt_epi64(_mm512_xor_si512(A, B)));
+    }
+
+    int64_t buff[8];
+    _mm512_storeu_si512(buff, accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7];
+}
+
+/**** CPUID ****/
+static void cpuid(int leaf, int subleaf, unsigned int registers[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i=0; i<4; i++)
+        registers[i] = info[i];
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Register state the operating system saves on context switches
+static uint64_t xgetbv()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64_t(edx) << 32) | eax;
+#endif
+}
+
+#endif // BR_X86
+
+struct Kernels
+{
+    L1Kernel l1, packedL1;
+    LookupKernel lookup;
+    DotKernel dot;
+    ToHalfKernel toHalf;
+    FromHalfKernel fromHalf;
+    HalfKernel l1Half, l2Half, dotHalf;
+    HammingKernel hamming;
+
+    Kernels() : l1(l1Scalar), packedL1(packedL1Scalar), lookup(lookupScalar), dot(dotTail),
+                toHalf(toHalfScalar), fromHalf(fromHalfScalar), l1Half(l1HalfTail), l2Half(l2HalfTail), dotHalf(dotHalfTail),
+                hamming(hammingScalar)
+    {
+#ifdef BR_X86
+        unsigned int registers[4];
+        cpuid(0, 0, registers);
+        const unsigned int maxLeaf = registers[0];
+
+        cpuid(1, 0, registers);
+        const bool sse2 = (registers[3] >> 26) & 1;
+        const bool osxsave = (registers[2] >> 27) & 1;
+        const uint64_t xcr0 = osxsave ? xgetbv() : 0;
+        const bool ymmState = (xcr0 & 0x06) == 0x06;
+        const bool f16c = ymmState && ((registers[2] >> 28) & 1) && ((registers[2] >> 29) & 1);
+        const bool popcnt = (registers[2] >> 23) & 1;
+        const bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+        bool avx2 = false, avx512f = false, avx512bw = false, avx512vpopcntdq = false;
+        if (maxLeaf >= 7) {
+            cpuid(7, 0, registers);
+            avx2 = ymmState && ((registers[1] >> 5) & 1);
+            avx512f = zmmState && ((registers[1] >> 16) & 1);
+            avx512bw = avx512f && ((registers[1] >> 30) & 1);
+            avx512vpopcntdq = avx512bw && ((registers[2] >> 14) & 1);
+        }
+
+        if (avx512bw) {
+            l1 = l1AVX512;
+            packedL1 = packedL1AVX512;
+            dot = dotAVX512;
+        } else if (avx2) {
+            l1 = l1AVX2;
+            packedL1 = packedL1AVX2;
+            dot = dotAVX2;
+        } else if (sse2) {
+            l1 = l1SSE2;
+            packedL1 = packedL1SSE2;
+            dot = dotSSE2;
+        }
+
+        if (avx512f)   lookup = lookupAVX512;
+        else if (avx2) lookup = lookupAVX2;
+
+        if (avx512vpopcntdq) hamming = hammingAVX512;
+        else if (avx2)       hamming = hammingAVX2;
+        else if (popcnt)     hamming = hammingPOPCNT;
+
+        if (f16c) {
+            toHalf = toHalfF16C;
+            fromHalf = fromHalfF16C;
+            l1Half = l1HalfF16C;
+            l2Half = l2HalfF16C;
+            dotHalf = dotHalfF16C;
+        }
+#endif // BR_X86
+    }
+};
+
+static const Kernels &kernels()
+{
+    static const Kernels kernels;
+    return kernels;
+}
+
+float l1(const uchar *a, const uchar *b, int size)
+{
+    return kernels().l1(a, b, size);
+}
+
+float packed_l1(const uchar *a, const uchar *b, int size)
+{
+    return kernels().packedL1(a, b, size);
+}
+
+float lookup_sum(const float *tables, const uchar *codes, int size)
+{
+    return kernels().lookup(tables, codes, size);
+}
+
+// The bound is checked between fixed size chunks so the vector kernels still do most of the work
+static const int boundedChunk = 128;
+
+float l1_bounded(const uchar *a, const uchar *b, int size, float bound)
+{
+    const L1Kernel kernel = kernels().l1;
+    float distance = 0;
+    for (int i=0; (i<size) && (distance <= bound); i+=boundedChunk)
+        distance += kernel(a+i, b+i, std::min(boundedChunk, size-i));
+    return distance;
+}
+
+float packed_l1_bounded(const uchar *a, const uchar *b, int size, float bound)
+{
+    const L1Kernel kernel = kernels().packedL1;
+    float distance = 0;
+    for (int i=0; (i<size) && (distance <= bound); i+=boundedChunk)
+        distance += kernel(a+i, b+i, std::min(boundedChunk, size-i));
+    return distance;
+}
+
+float hamming(const uchar *a, const uchar *b, int size)
+{
+    return kernels().hamming(a, b, size);
+}
+
+void float_to_half(const float *src, ushort *dst, int size)
+{
+    kernels().toHalf(src, dst, size);
+}
+
+void half_to_float(const ushort *src, float *dst, int size)
+{
+    kernels().fromHalf(src, dst, size);
+}
+
+float l1_half(const ushort *a, const ushort *b, int size)
+{
+    return kernels().l1Half(a, b, size);
+}
+
+float l2_half(const ushort *a, const ushort *b, int size)
+{
+    return kernels().l2Half(a, b, size);
+}
+
+float dot_half(const ushort *a, const ushort *b, int size)
+{
+    return kernels().dotHalf(a, b, size);
+}
+
+// Short enough chunks that no 32-bit lane of the kernels overflows, with weights in [-32767, 32767]
+static const int dotChunk = 512;
+
+qint64 dot_u8(const short *weights, const uchar *codes, int size)
+{
+    const DotKernel kernel = kernels().dot;
+    qint64 sum = 0;
+    for (int i=0; i<size; i+=dotChunk)
+        sum += kernel(weights+i, codes+i, std::min(dotChunk, size-i));
+    return sum;
+}
@@ -19,9 +19,9 @@
 
 #include <QDebug>
 
-#ifdef __SSE__
+#ifdef __SSE2__
 
-#include <xmmintrin.h>
+#include <emmintrin.h>
 
 inline QDebug operator<<(QDebug dbg, const __m128i &p)
 {
@@ -31,45 +31,71 @@ inline QDebug operator<<(QDebug dbg, const __m128i &p)
     return dbg.space();
 }
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    size = size / sizeof(__m128i);
-    __m128i accumulate = _mm_setzero_si128();
-
-    for (int i=0; i<size; i++) {
-        __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)+i);
-        __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)+i);
-        __m128i sad = _mm_sad_epu8(A, B);
-        accumulate = _mm_add_epi64(sad, accumulate);
-    }
-
-    int64_t buff[2];
-    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff), accumulate);
-    return buff[0] + buff[1];
-}
+#endif // __SSE2__
 
-#else
+/*!
+ * \brief L1 distance between two vectors of \em size 8-bit values.
+ * \note Dispatched at runtime to the widest of the SSE2, AVX2 and AVX-512BW kernels supported by the CPU.
+ */
+float l1(const uchar *a, const uchar *b, int size);
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += abs(a[i]-b[i]);
-    return distance;
-}
+/*!
+ * \brief L1 distance between two vectors of \em size bytes, each byte packing two 4-bit values.
+ */
+float packed_l1(const uchar *a, const uchar *b, int size);
 
-#endif
+/*!
+ * \brief l1() which may stop early, returning a partial distance, once the distance exceeds \em bound.
+ */
+float l1_bounded(const uchar *a, const uchar *b, int size, float bound);
 
-inline float packed_l1(const uchar *a, const uchar *b, int size)
-{
-    static const uchar low_mask = 0x0F;
-    static const uchar hi_mask = 0xF0;
-
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
-                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
-    return distance;
-}
+/*!
+ * \brief packed_l1() which may stop early, returning a partial distance, once the distance exceeds \em bound.
+ */
+float packed_l1_bounded(const uchar *a, const uchar *b, int size, float bound);
+
+/*!
+ * \brief Number of differing bits between two vectors of \em size bytes.
+ * \note Dispatched at runtime to the AVX-512 VPOPCNTDQ, AVX2 or POPCNT kernels when supported by the CPU.
+ */
+float hamming(const uchar *a, const uchar *b, int size);
+
+/*!
+ * \brief Sum of <tt>tables[i*256 + codes[i]]</tt> over the \em size codes, one 256-entry table per code.
+ * \note Dispatched at runtime to the AVX2 or AVX-512 gather kernels when supported by the CPU.
+ */
+float lookup_sum(const float *tables, const uchar *codes, int size);
+
+/*!
+ * \brief Dot product of \em size 16-bit weights, each in [-32767, 32767], with \em size 8-bit codes, computed exactly in integer arithmetic.
+ * \note Dispatched at runtime to the widest of the SSE2, AVX2 and AVX-512BW kernels supported by the CPU.
+ */
+qint64 dot_u8(const short *weights, const uchar *codes, int size);
+
+/*!
+ * \brief Convert \em size floats to IEEE half precision, rounding to the nearest even value.
+ * \note This and the other half precision functions are dispatched at runtime to F16C kernels when supported by the CPU.
+ */
+void float_to_half(const float *src, ushort *dst, int size);
+
+/*!
+ * \brief Convert \em size IEEE half precision values to floats.
+ */
+void half_to_float(const ushort *src, float *dst, int size);
+
+/*!
+ * \brief L1 distance between two vectors of \em size half precision values.
+ */
+float l1_half(const ushort *a, const ushort *b, int size);
+
+/*!
+ * \brief Squared L2 distance between two vectors of \em size half precision values.
+ */
+float l2_half(const ushort *a, const ushort *b, int size);
+
+/*!
+ * \brief Dot product of two vectors of \em size half precision values.
+ */
+float dot_half(const ushort *a, const ushort *b, int size);
 
 #endif // DISTANCE_SSE_H
@@ -0,0 +1,135 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QDataStream>
+#include <QFile>
+#include <math.h>
+
+#include "ivf.h"
+#include "qtutils.h"
+
+using namespace cv;
+
+namespace br
+{
+
+void InvertedFile::build(const TemplateList &gallery, int nlist)
+{
+    templates = gallery;
+    lists.clear();
+    unindexed.clear();
+    quantizer.clear();
+
+    dimensions = 0;
+    foreach (const Template &t, templates)
+        if ((t.size() == 1) && t.first().data) {
+            dimensions = int(t.first().total() * t.first().channels());
+            break;
+        }
+
+    QVector<int> indexed;
+    for (int i=0; i<templates.size(); i++)
+        if (indexable(templates[i])) indexed.append(i);
+        else                         unindexed.append(i);
+    if (indexed.isEmpty())
+        return;
+
+    if (nlist <= 0)
+        nlist = int(4 * sqrt(double(indexed.size())));
+    nlist = qBound(1, nlist, indexed.size());
+
+    // An evenly strided sample of a few dozen templates per centroid is plenty to train on
+    const int trainingSize = qMin(indexed.size(), 64 * nlist);
+    TemplateList training;
+    for (int i=0; i<trainingSize; i++)
+        training.append(Template(toRow(templates[indexed[int(qint64(i) * indexed.size() / trainingSize)]].first())));
+
+    quantizer = QSharedPointer<Transform>(Transform::make(QString("KMeans(kTrain=%1)").arg(nlist), NULL));
+    quantizer->train(training);
+
+    lists = QVector< QVector<int> >(nlist);
+    setProbes(1);
+    foreach (int i, indexed)
+        lists[probe(templates[i]).first()].append(i);
+
+    qDebug("Indexed %d templates in %d lists, %d unindexed", indexed.size(), nlist, unindexed.size());
+}
+
+bool InvertedFile::indexable(const Template &t) const
+{
+    return (dimensions > 0) && (t.size() == 1) && t.first().data &&
+           (int(t.first().total() * t.first().channels()) == dimensions);
+}
+
+void InvertedFile::setProbes(int nprobe)
+{
+    if (quantizer)
+        quantizer->setProperty("kSearch", qBound(1, nprobe, lists.size()));
+}
+
+QVector<int> InvertedFile::probe(const Template &query) const
+{
+    QVector<int> nearest;
+    if (!quantizer || !indexable(query))
+        return nearest;
+
+    Template dst;
+    quantizer->project(Template(toRow(query.first())), dst);
+    const Mat &indices = dst.m();
+    for (int i=0; i<int(indices.total()); i++)
+        nearest.append(indices.at<int>(i));
+    return nearest;
+}
+
+void InvertedFile::load(const QString &fileName)
+{
+    QByteArray data;
+    QtUtils::readFile(fileName, data);
+    QDataStream stream(&data, QFile::ReadOnly);
+
+    bool quantized;
+    stream >> dimensions >> lists >> unindexed >> quantized;
+    quantizer.clear();
+    if (quantized) {
+        quantizer = QSharedPointer<Transform>(Transform::make("KMeans", NULL));
+        quantizer->load(stream);
+    }
+    stream >> templates;
+}
+
+void InvertedFile::store(const QString &fileName) const
+{
+    QByteArray data;
+    QDataStream stream(&data, QFile::WriteOnly);
+
+    stream << dimensions << lists << unindexed << !quantizer.isNull();
+    if (quantizer)
+        quantizer->store(stream);
+    stream << templates;
+
+    QtUtils::writeFile(fileName, data);
+}
+
+// KMeansTransform clusters single precision rows
+Mat InvertedFile::toRow(const Mat &m)
+{
+    Mat row;
+    (m.isContinuous() ? m : m.clone()).reshape(1, 1).convertTo(row, CV_32F);
+    return row;
+}
+
+} // namespace br
@@ -0,0 +1,67 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef BR_IVF_H
+#define BR_IVF_H
+
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief An inverted file index over a gallery of enrolled templates.
+ *
+ * Single-matrix templates are assigned to their nearest coarse k-means centroid (see KMeansTransform),
+ * so a search need only visit the lists of the centroids nearest to the query.
+ * Templates that can't be quantized are kept aside and visited by every search.
+ */
+class InvertedFile
+{
+public:
+    TemplateList templates; /*!< \brief The indexed gallery in its original order. */
+    QVector< QVector<int> > lists; /*!< \brief Gallery indices assigned to each centroid. */
+    QVector<int> unindexed; /*!< \brief Gallery indices visited by every search. */
+
+    InvertedFile() : dimensions(0) {}
+
+    /*!
+     * \brief Cluster \em gallery into \em nlist centroids and build the inverted lists.
+     * \note A non-positive \em nlist defaults to four times the square root of the gallery size.
+     */
+    void build(const TemplateList &gallery, int nlist = 0);
+
+    bool indexable(const Template &t) const; /*!< \brief Whether \em t can be assigned to a centroid. */
+    void setProbes(int nprobe); /*!< \brief The number of lists visited by probe(). Not thread safe. */
+    QVector<int> probe(const Template &query) const; /*!< \brief Lists nearest to \em query, nearest first. */
+
+    void load(const QString &fileName);
+    void store(const QString &fileName) const;
+
+private:
+    QSharedPointer<Transform> quantizer;
+    int dimensions;
+
+    static cv::Mat toRow(const cv::Mat &m);
+};
+
+} // namespace br
+
+#endif // BR_IVF_H
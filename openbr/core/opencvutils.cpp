@@ -20,6 +20,7 @@
 #include <opencv2/imgproc/imgproc_c.h>
 #include <openbr/openbr_plugin.h>
 
+#include "distance_sse.h"
 #include "opencvutils.h"
 #include "qtutils.h"
 
@@ -112,6 +113,31 @@ void OpenCVUtils::cvtUChar(const Mat &src, Mat &dst)
     }
 }
 
+void OpenCVUtils::cvtHalf(const Mat &src, Mat &dst)
+{
+    // OpenCV 2.4 has no half precision depth, so the values are stored in a 16-bit depth of the same size
+    Mat single;
+    if (src.depth() == CV_32F) single = src.isContinuous() ? src : src.clone();
+    else                       src.convertTo(single, CV_32F);
+
+    Mat half(src.rows, src.cols, CV_MAKETYPE(CV_16U, src.channels()));
+    float_to_half(single.ptr<float>(), half.ptr<ushort>(), int(single.total() * single.channels()));
+    dst = half;
+}
+
+void OpenCVUtils::cvtFloat(const Mat &src, Mat &dst, bool half)
+{
+    if (!half || (src.depth() != CV_16U)) {
+        src.convertTo(dst, CV_32F);
+        return;
+    }
+
+    const Mat values = src.isContinuous() ? src : src.clone();
+    Mat single(src.rows, src.cols, CV_MAKETYPE(CV_32F, src.channels()));
+    half_to_float(values.ptr<ushort>(), single.ptr<float>(), int(values.total() * values.channels()));
+    dst = single;
+}
+
 Mat OpenCVUtils::toMat(const QList<float> &src, int rows)
 {
     if (rows == -1) rows = src.size();
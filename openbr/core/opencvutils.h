@@ -34,6 +34,8 @@ namespace OpenCVUtils
     // Convert image
     void cvtGray(const cv::Mat &src, cv::Mat &dst);
     void cvtUChar(const cv::Mat &src, cv::Mat &dst);
+    void cvtHalf(const cv::Mat &src, cv::Mat &dst);  // To IEEE half precision, stored as CV_16U
+    void cvtFloat(const cv::Mat &src, cv::Mat &dst, bool half = false); // To CV_32F, reading CV_16U as half precision if half is set
 
     // To image
     cv::Mat toMat(const QList<float> &src, int rows = -1);
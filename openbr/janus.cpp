@@ -1,3 +1,7 @@
+#include <QtConcurrent>
+#include <algorithm>
+#include <vector>
+
 #include "iarpa_janus.h"
 #include "iarpa_janus_io.h"
 #include "openbr_plugin.h"
@@ -155,47 +159,50 @@ janus_error janus_flatten_gallery(janus_gallery gallery, janus_flat_gallery flat
     *bytes = 0;
     foreach (const janus_template &t, *gallery) {
         janus_template_id template_id = t->file.get<janus_template_id>("TEMPLATE_ID");
-
-        janus_flat_template u = new janus_data[janus_max_template_size()];
-        size_t t_bytes = 0;
-        JANUS_ASSERT(janus_flatten_template(t, u, &t_bytes))
         memcpy(flat_gallery, &template_id, sizeof(template_id));
         flat_gallery += sizeof(template_id);
         *bytes += sizeof(template_id);
 
+        // Flatten the template in place, after the space for its size
+        size_t t_bytes = 0;
+        JANUS_ASSERT(janus_flatten_template(t, flat_gallery + sizeof(t_bytes), &t_bytes))
         memcpy(flat_gallery, &t_bytes, sizeof(t_bytes));
-        flat_gallery += sizeof(t_bytes);
-        *bytes += sizeof(t_bytes);
-
-        memcpy(flat_gallery, u, t_bytes);
-        flat_gallery += t_bytes;
-        *bytes += t_bytes;
-        delete[] u;
+        flat_gallery += sizeof(t_bytes) + t_bytes;
+        *bytes += sizeof(t_bytes) + t_bytes;
     }
     return JANUS_SUCCESS;
 }
 
-janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, const janus_flat_template b, const size_t b_bytes, float *similarity)
+// Matrix headers viewing each template in a flat template, without copying
+static QVector<cv::Mat> views(const janus_flat_template flat_template, const size_t bytes)
+{
+    QVector<cv::Mat> templates;
+    janus_flat_template t = flat_template;
+    while (t < flat_template + bytes) {
+        const size_t t_bytes = *reinterpret_cast<size_t*>(t);
+        t += sizeof(t_bytes);
+        templates.append(cv::Mat(1, t_bytes, CV_8UC1, t));
+        t += t_bytes;
+    }
+    return templates;
+}
+
+// Average similarity between the viewed templates and each template in a flat template
+static janus_error verify(const QVector<cv::Mat> &a, const janus_flat_template b, const size_t b_bytes, float *similarity)
 {
     *similarity = 0;
 
     int comparisons = 0;
-    janus_flat_template a_template = a;
-    while (a_template < a + a_bytes) {
-        const size_t a_template_bytes = *reinterpret_cast<size_t*>(a_template);
-        a_template += sizeof(a_template_bytes);
+    foreach (const cv::Mat &a_template, a) {
         janus_flat_template b_template = b;
         while (b_template < b + b_bytes) {
-                const size_t b_template_bytes = *reinterpret_cast<size_t*>(b_template);
-                b_template += sizeof(b_template_bytes);
-                *similarity += distance->compare(cv::Mat(1, a_template_bytes, CV_8UC1, a_template),
-                                                 cv::Mat(1, b_template_bytes, CV_8UC1, b_template));
-                comparisons++;
+            const size_t b_template_bytes = *reinterpret_cast<size_t*>(b_template);
+            b_template += sizeof(b_template_bytes);
+            *similarity += distance->compare(a_template, cv::Mat(1, b_template_bytes, CV_8UC1, b_template));
+            comparisons++;
 
-                b_template += b_template_bytes;
+            b_template += b_template_bytes;
         }
-
-        a_template += a_template_bytes;
     }
 
     if (*similarity != *similarity) // True for NaN
@@ -206,43 +213,116 @@ janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, cons
     return JANUS_SUCCESS;
 }
 
-janus_error janus_search(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const size_t gallery_bytes, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, const janus_flat_template b, const size_t b_bytes, float *similarity)
 {
-    typedef QPair<float, int> Pair;
-    QList<Pair> comparisons; comparisons.reserve(requested_returns);
-    janus_flat_gallery target_gallery = gallery;
-    while (target_gallery < gallery + gallery_bytes) {
-        janus_template_id target_id = *reinterpret_cast<janus_template_id*>(target_gallery);
-        target_gallery += sizeof(target_id);
+    return verify(views(a, a_bytes), b, b_bytes, similarity);
+}
+
+namespace {
+
+// A template in a flat gallery
+struct GalleryEntry
+{
+    janus_template_id id;
+    janus_flat_template data;
+    size_t bytes;
+};
 
-        const size_t target_template_bytes = *reinterpret_cast<size_t*>(target_gallery);
-        target_gallery += sizeof(target_template_bytes);
-        janus_flat_template target_template_flat = new janus_data[target_template_bytes];
-        memcpy(target_template_flat, target_gallery, target_template_bytes);
-        target_gallery += target_template_bytes;
+struct Match
+{
+    float similarity;
+    int index; // Into the gallery entries
+
+    Match(float similarity, int index)
+        : similarity(similarity), index(index) {}
+
+    // Higher similarities first, ties broken by gallery order
+    bool operator<(const Match &other) const
+    {
+        if (similarity != other.similarity) return similarity > other.similarity;
+        return index < other.index;
+    }
+};
+
+// std::*_heap with operator< keeps the worst match at the front
+typedef std::vector<Match> Heap;
 
+void searchRange(const QVector<cv::Mat> *probe, const std::vector<GalleryEntry> *entries, int begin, int end, size_t requested_returns, Heap *heap, janus_error *error)
+{
+    heap->reserve(requested_returns+1);
+    for (int i=begin; i<end; i++) {
+        const GalleryEntry &entry = (*entries)[i];
         float similarity;
-        JANUS_ASSERT(janus_verify(probe, probe_bytes, target_template_flat, target_template_bytes, &similarity))
-        if (comparisons.size() < requested_returns) {
-            comparisons.append(Pair(similarity, target_id));
-            std::sort(comparisons.begin(), comparisons.end());
-        } else {
-            Pair temp = comparisons.first();
-            if (temp.first < similarity) {
-                comparisons.removeFirst();
-                comparisons.append(Pair(similarity, target_id));
-                std::sort(comparisons.begin(), comparisons.end());
-            }
+        const janus_error result = verify(*probe, entry.data, entry.bytes, &similarity);
+        if (result != JANUS_SUCCESS) {
+            *error = result;
+            return;
+        }
+
+        const Match match(similarity, i);
+        if (heap->size() == requested_returns) {
+            if (!(match < heap->front()))
+                continue;
+            std::pop_heap(heap->begin(), heap->end());
+            heap->pop_back();
         }
-        delete[] target_template_flat;
+        heap->push_back(match);
+        std::push_heap(heap->begin(), heap->end());
+    }
+}
+
+} // namespace
+
+janus_error janus_search(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const size_t gallery_bytes, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+{
+    *actual_returns = 0;
+    if (requested_returns <= 0)
+        return JANUS_SUCCESS;
+
+    // Index the gallery in place
+    std::vector<GalleryEntry> entries;
+    janus_flat_gallery target_gallery = gallery;
+    while (target_gallery < gallery + gallery_bytes) {
+        GalleryEntry entry;
+        entry.id = *reinterpret_cast<janus_template_id*>(target_gallery);
+        target_gallery += sizeof(entry.id);
+        entry.bytes = *reinterpret_cast<size_t*>(target_gallery);
+        target_gallery += sizeof(entry.bytes);
+        entry.data = target_gallery;
+        target_gallery += entry.bytes;
+        entries.push_back(entry);
+    }
+
+    // Each thread scans a contiguous range of the gallery into its own heap
+    const QVector<cv::Mat> probeTemplates = views(probe, probe_bytes);
+    const int ranges = std::max(1, std::min(Globals->parallelism, int(entries.size())/64));
+    std::vector<Heap> heaps(ranges);
+    std::vector<janus_error> errors(ranges, JANUS_SUCCESS);
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<ranges; i++) {
+        const int begin = int(qint64(entries.size()) * i / ranges);
+        const int end = int(qint64(entries.size()) * (i+1) / ranges);
+        if (ranges > 1) futures.addFuture(QtConcurrent::run(searchRange, &probeTemplates, &entries, begin, end, size_t(requested_returns), &heaps[i], &errors[i]));
+        else            searchRange(&probeTemplates, &entries, begin, end, size_t(requested_returns), &heaps[i], &errors[i]);
     }
-    *actual_returns = comparisons.size();
-    QList<Pair> temp; temp.reserve(comparisons.size());
-    std::reverse_copy(comparisons.begin(), comparisons.end(), std::back_inserter(temp));
-    comparisons = temp;
-    foreach(const Pair &comparison, comparisons) {
-        *similarities = comparison.first; similarities++;
-        *template_ids = comparison.second; template_ids++;
+    futures.waitForFinished();
+
+    for (int i=0; i<ranges; i++)
+        if (errors[i] != JANUS_SUCCESS)
+            return errors[i];
+
+    // Merge the heaps and keep the best
+    Heap matches;
+    for (int i=0; i<ranges; i++)
+        matches.insert(matches.end(), heaps[i].begin(), heaps[i].end());
+    const size_t returns = std::min(matches.size(), size_t(requested_returns));
+    std::partial_sort(matches.begin(), matches.begin() + returns, matches.end());
+
+    *actual_returns = int(returns);
+    for (size_t i=0; i<returns; i++) {
+        similarities[i] = matches[i].similarity;
+        template_ids[i] = entries[matches[i].index].id;
     }
     return JANUS_SUCCESS;
 }
@@ -75,6 +75,7 @@ BR_EXPORT void br_cat(int num_input_galleries, const char *input_galleries[], co
  * \param output_gallery Deduplicated gallery.
  * \param threshold Comparisons with a match score >= this value are designated to be duplicates.
  * \note If a gallery contains n duplicates, the first n-1 duplicates in the gallery will be removed and the nth will be kept.
+ *       Duplicates are grouped transitively, and the kept template lists the names of the removed ones in its \c Duplicates metadata.
  * \note Users are encouraged to use binary gallery formats as the entire gallery is read into memory in one call to Gallery::read.
  */
 
@@ -112,12 +113,25 @@ BR_EXPORT void br_combine_masks(int num_input_masks, const char *input_masks[],
  *                      A value of '.' reuses the target gallery as the query gallery.
  * \param output Optional br::Output file to contain the results of comparing the templates.
  *               The default behavior is to print scores to the terminal.
+ * \note An <tt>.ivf</tt> target gallery, built with <tt>br_convert("Gallery", "watchlist.gal", "watchlist.ivf[nlist=4096]")</tt>,
+ *       is searched approximately: only the templates in the \c nprobe inverted lists nearest each query are compared
+ *       and every other score is the lowest representable value.
+ *       For example <tt>watchlist.ivf[nprobe=16,recall=100]</tt> probes 16 lists and compares every 100th query exhaustively
+ *       to report the recall of the index.
+ * \note A target gallery with the \c quantize argument, such as <tt>watchlist.gal[quantize=true,rerank=100]</tt>,
+ *       is scanned as an 8-bit quantized copy held in memory and only the \c rerank best scores of each query are computed exactly.
+ *       This requires single-matrix floating point templates and a distance implementing br::Distance::compareProducts.
+ * \note A target gallery of several shards with the \c sharded argument, such as <tt>east.gal;west.gal(separator=;,sharded=true,topK=50)</tt>,
+ *       is searched one shard per worker set and only the \c topK best scores of each query across all shards are kept,
+ *       every other score is the lowest representable value.
+ *       With <tt>shardMemory=4096</tt> only as many shards as fit in 4096 megabytes are loaded at a time.
  * \see br_enroll
  */
 BR_EXPORT void br_compare(const char *target_gallery, const char *query_gallery, const char *output = "");
 
 /*!
  * \brief Convenience function for comparing to multiple targets.
+ * \note The targets are compared as one concatenated gallery, see br_compare for searching them as shards.
  * \see br_compare
  */
 BR_EXPORT void br_compare_n(int num_targets, const char *target_galleries[], const char *query_gallery, const char *output);
@@ -1332,6 +1332,12 @@ void Output::setRelative(float value, int i, int j)
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
+float Output::lowerBound() const
+{
+    if (next.isNull()) return bound();
+    return std::min(bound(), next->lowerBound());
+}
+
 Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
 {
     Output *output = NULL;
@@ -1642,13 +1648,64 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
     return -std::numeric_limits<float>::max();
 }
 
+bool Distance::compareBatch(const Mat &, const Mat &, Mat &, float, float) const
+{
+    return false;
+}
+
+bool Distance::compareProducts(const Mat &, const Mat &, const Mat &, Mat &) const
+{
+    return false;
+}
+
+float Distance::compareBounded(const Template &a, const Template &b, float, float) const
+{
+    return compare(a, b);
+}
+
 /* Distance - private methods */
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
-    for (int i=0; i<query.size(); i++)
-        for (int j=0; j<target.size(); j++)
-            if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
-            else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+    // Score the block one tile at a time so that packed tiles and their scores stay cache resident
+    static const int queryTile = 256, targetTile = 1024;
+
+    // Outputs discarding low scores let the distance give up on them early
+    const float lower = output->lowerBound(), upper = std::numeric_limits<float>::max();
+    const bool bounded = lower > -std::numeric_limits<float>::max();
+
+    // Each target tile is packed once, the first time it is needed, and reused for every query tile
+    const bool batched = batches();
+    QVector<Mat> targetRows((target.size() + targetTile - 1) / targetTile);
+    QVector<int> targetsPacked(targetRows.size(), -1);
+
+    for (int i=0; i<query.size(); i+=queryTile) {
+        const TemplateList queries = query.mid(i, queryTile);
+        Mat queryRows;
+        const bool queriesPacked = batched && queries.pack(queryRows);
+
+        for (int j=0; j<target.size(); j+=targetTile) {
+            const TemplateList targets = target.mid(j, targetTile);
+            const int tile = j / targetTile;
+            if (queriesPacked && (targetsPacked[tile] == -1))
+                targetsPacked[tile] = targets.pack(targetRows[tile]) ? 1 : 0;
+
+            Mat scores;
+            if (queriesPacked && (targetsPacked[tile] == 1) && compareBatch(targetRows[tile], queryRows, scores, lower, upper)) {
+                for (int k=0; k<queries.size(); k++) {
+                    const float *score = scores.ptr<float>(k);
+                    for (int l=0; l<targets.size(); l++)
+                        output->setRelative(score[l], i+k+queryOffset, j+l+targetOffset);
+                }
+                continue;
+            }
+
+            for (int k=0; k<queries.size(); k++)
+                for (int l=0; l<targets.size(); l++)
+                    if (targets[l].isEmpty() || queries[k].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(), i+k+queryOffset, j+l+targetOffset);
+                    else if (bounded) output->setRelative(compareBounded(targets[l], queries[k], lower, upper), i+k+queryOffset, j+l+targetOffset);
+                    else output->setRelative(compare(targets[l], queries[k]), i+k+queryOffset, j+l+targetOffset);
+        }
+    }
 }
 
 void br::applyAdditionalProperties(const File &temp, Transform *target)
@@ -428,6 +428,26 @@ struct Template : public QList<cv::Mat>
         foreach (const cv::Mat &m, *this) other += m.clone();
         return other;
     }
+
+    /*!
+     * \brief Copies each matrix into the corresponding row of \em packed, as br::TemplateList::pack() does for a list of templates.
+     *
+     * Returns \c false, leaving \em packed untouched, unless every matrix is continuous and of the same size and type.
+     */
+    bool pack(cv::Mat &packed) const
+    {
+        if (isEmpty()) return false;
+        const cv::Mat &reference = first();
+        foreach (const cv::Mat &m, *this)
+            if (!m.data || !m.isContinuous() || (m.size != reference.size) || (m.type() != reference.type()))
+                return false;
+
+        const size_t rowBytes = reference.total() * reference.elemSize();
+        packed.create(size(), int(reference.total() * reference.channels()), reference.depth());
+        for (int i=0; i<size(); i++)
+            memcpy(packed.ptr(i), at(i).data, rowBytes);
+        return true;
+    }
 };
 
 /*!
@@ -483,6 +503,27 @@ struct TemplateList : public QList<Template>
         return data;
     }
 
+    /*!
+     * \brief Copies the matrix of each template into the corresponding row of \em packed.
+     *
+     * Returns \c false, leaving \em packed untouched, unless every template holds exactly one continuous matrix of the same size and type.
+     */
+    bool pack(cv::Mat &packed) const
+    {
+        if (isEmpty() || (first().size() != 1)) return false;
+        const cv::Mat &reference = first().first();
+        foreach (const Template &t, *this)
+            if ((t.size() != 1) || !t.first().data || !t.first().isContinuous() ||
+                (t.first().size != reference.size) || (t.first().type() != reference.type()))
+                return false;
+
+        const size_t rowBytes = reference.total() * reference.elemSize();
+        packed.create(size(), int(reference.total() * reference.channels()), reference.depth());
+        for (int i=0; i<size(); i++)
+            memcpy(packed.ptr(i), at(i).first().data, rowBytes);
+        return true;
+    }
+
     /*!
      * \brief Returns a list of #br::TemplateList with each #br::Template in a given #br::TemplateList containing the number of matrices specified by \em partitionSizes.
      */
@@ -1045,6 +1086,7 @@ public:
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Initializes class data members. */
     virtual void setBlock(int rowBlock, int columnBlock); /*!< \brief Set the current block. */
     virtual void setRelative(float value, int i, int j); /*!< \brief Set a score relative to the current block. */
+    float lowerBound() const; /*!< \brief Scores below this value need not be exact, it suffices to know they are below it. \see Distance::compareBounded */
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Make an output from a file and gallery/probe file lists. */
 
@@ -1052,6 +1094,7 @@ private:
     QSharedPointer<Output> next;
     QPoint offset;
     virtual void set(float value, int i, int j) = 0;
+    virtual float bound() const { return -std::numeric_limits<float>::max(); } /*!< \brief The lower bound of this output alone. */
 };
 
 /*!
@@ -1380,6 +1423,64 @@ public:
     virtual float compare(const cv::Mat &a, const cv::Mat &b) const; /*!< \brief Compute the distance between two biometric signatures. */
     virtual float compare(const uchar *a, const uchar *b, size_t size) const; /*!< \brief Compute the distance between two buffers. */
 
+    /*!
+     * \brief Compute the distance between every row of \em queries and every row of \em targets.
+     *
+     * Each row is a template packed by br::TemplateList::pack().
+     * On success \em scores is a \em queries.rows by \em targets.rows \c CV_32FC1 matrix.
+     * Returns \c false if the distance does not support batched comparison of the given matrices,
+     * in which case the caller should fall back to comparing templates individually.
+     * \em lower and \em upper are interpreted as in compareBounded().
+     */
+    virtual bool compareBatch(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores,
+                              float lower = -std::numeric_limits<float>::max(), float upper = std::numeric_limits<float>::max()) const;
+
+    /*!
+     * \brief \c true if compareBatch() may succeed, callers skip packing templates when it is \c false.
+     */
+    virtual bool batches() const { return false; }
+
+    /*!
+     * \brief \c true if swapping the target and query never changes the score, letting a self-comparison score each pair once.
+     */
+    virtual bool symmetric() const { return false; }
+
+    /*!
+     * \brief Compute scores from the inner products of targets and queries and their squared norms.
+     *
+     * \em products is a queries by targets \c CV_32FC1 matrix of inner products,
+     * \em targetNorms and \em queryNorms are continuous \c CV_32FC1 matrices holding one squared norm per target and query.
+     * On success \em scores, which may share data with \em products, holds the scores compareBatch() would compute from them.
+     * Returns \c false if the distance is not a function of inner products and norms.
+     */
+    virtual bool compareProducts(const cv::Mat &products, const cv::Mat &targetNorms, const cv::Mat &queryNorms, cv::Mat &scores) const;
+
+    /*!
+     * \brief Compute the distance between two templates when only scores within [\em lower, \em upper] are needed exactly.
+     *
+     * A score outside the bounds may instead be reported as any value beyond the bound it crosses,
+     * letting the distance stop as soon as a partial result provably crosses it.
+     * Distances wrapping another distance translate the bounds into the wrapped distance's scores.
+     * The default implementation ignores the bounds.
+     */
+    virtual float compareBounded(const Template &a, const Template &b, float lower, float upper) const;
+
+    /*!
+     * \brief Precompute per-target state, such as search indexes, for repeated comparisons against \em targets.
+     *
+     * Replaces the state of any previous call.
+     * Later comparisons against these exact target matrices may use it, so \em targets should outlive them.
+     * The default implementation does nothing.
+     */
+    virtual void prepareTargets(const TemplateList &targets) { (void) targets; }
+
+    /*!
+     * \brief Return a pointer to a simplified version of this distance computing the same scores (if possible), see Transform::simplify.
+     * Set newDistance to true if the distance returned is newly allocated.
+     * Simplification reads the trained parameters of the distance, so it should be repeated after training or loading.
+     */
+    virtual Distance *simplify(bool &newDistance) { newDistance = false; return this; }
+
 protected:
     inline Distance *make(const QString &description) { return make(description, this); } /*!< \brief Make a subdistance. */
 
@@ -15,7 +15,6 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/common.h>
 
 using namespace cv;
 
@@ -46,34 +45,86 @@ class KNNTransform : public Transform
     BR_PROPERTY(QString, galleryName, "")
 
     TemplateList gallery;
+    QStringList labels; // Distinct values of inputVariable in the gallery
+    QVector<int> labelIds; // Index into labels for each gallery template
+
+    void indexLabels()
+    {
+        labels.clear();
+        labelIds.clear();
+        labelIds.reserve(gallery.size());
+        QHash<QString, int> ids;
+        foreach (const Template &t, gallery) {
+            const QString label = t.file.get<QString>(inputVariable);
+            if (!ids.contains(label)) {
+                ids.insert(label, labels.size());
+                labels.append(label);
+            }
+            labelIds.append(ids[label]);
+        }
+    }
 
     void train(const TemplateList &data)
     {
         distance->train(data);
         gallery = data;
+        indexLabels();
     }
 
     void project(const Template &src, Template &dst) const
     {
-        QList< QPair<float, int> > sortedScores = Common::Sort(distance->compare(gallery, src), true);
-
+        const QList<float> scores = distance->compare(gallery, src);
+        typedef QPair<float, int> Score;
+        std::vector<Score> candidates; candidates.reserve(scores.size());
+        for (int i=0; i<scores.size(); i++)
+            candidates.push_back(Score(scores[i], i));
+
+        QVector<float> votes(labels.size(), 0);
+        QVector<bool> hasVotes(labels.size(), false);
+        QVector<int> voted; // Labels with votes this round, in order of their best neighbor
         QStringList subjects;
-        for (int i=0; i<numSubjects; i++) {
-            QHash<QString, float> votes;
-            const int max = (k < 1) ? sortedScores.size() : std::min(k, sortedScores.size());
-            for (int j=0; j<max; j++)
-                votes[gallery[sortedScores[j].second].file.get<QString>(inputVariable)] += (weighted ? sortedScores[j].first : 1);
-            subjects.append(votes.keys()[votes.values().indexOf(Common::Max(votes.values()))]);
+        for (int i=0; (i<numSubjects) && !candidates.empty(); i++) {
+            // Only the k best need to be ordered
+            const int max = (k < 1) ? int(candidates.size()) : std::min(k, int(candidates.size()));
+            std::partial_sort(candidates.begin(), candidates.begin()+max, candidates.end(), std::greater<Score>());
+
+            for (int j=0; j<max; j++) {
+                const int label = labelIds[candidates[j].second];
+                if (!hasVotes[label]) {
+                    hasVotes[label] = true;
+                    voted.append(label);
+                }
+                votes[label] += (weighted ? candidates[j].first : 1);
+            }
+
+            int best = voted.first();
+            foreach (int label, voted)
+                if (votes[label] > votes[best])
+                    best = label;
+            subjects.append(labels[best]);
+
+            foreach (int label, voted) {
+                votes[label] = 0;
+                hasVotes[label] = false;
+            }
+            voted.clear();
 
             // Remove subject from consideration
-            if (subjects.size() < numSubjects)
-                for (int j=sortedScores.size()-1; j>=0; j--)
-                    if (gallery[sortedScores[j].second].file.get<QString>(inputVariable) == subjects.last())
-                        sortedScores.removeAt(j);
+            if (subjects.size() < numSubjects) {
+                std::vector<Score>::iterator end = candidates.begin();
+                for (std::vector<Score>::const_iterator candidate = candidates.begin(); candidate != candidates.end(); ++candidate)
+                    if (labelIds[candidate->second] != best)
+                        *end++ = *candidate;
+                candidates.erase(end, candidates.end());
+            }
         }
 
+        if (subjects.isEmpty())
+            qFatal("KNN gallery has no templates to vote.");
+
         dst.file.set(outputVariable, subjects.size() > 1 ? "[" + subjects.join(",") + "]" : subjects.first());
-        dst.file.set("Nearest", gallery[sortedScores[0].second].file.name);
+        if (!candidates.empty())
+            dst.file.set("Nearest", gallery[std::max_element(candidates.begin(), candidates.end())->second].file.name);
     }
 
     void store(QDataStream &stream) const
@@ -84,12 +135,14 @@ class KNNTransform : public Transform
     void load(QDataStream &stream)
     {
         stream >> gallery;
+        indexLabels();
     }
 
     void init()
     {
         if (!galleryName.isEmpty())
             gallery = TemplateList::fromGallery(galleryName);
+        indexLabels();
     }
 };
 
@@ -24,6 +24,13 @@ namespace br
  * \ingroup transforms
  * \brief Compare each template to a fixed gallery (with name = galleryName), using the specified distance.
  * dst will contain a 1 by n vector of scores.
+ *
+ * If the distance supports br::Distance::compareBatch, single-matrix gallery templates are packed
+ * into one aligned, fixed-stride buffer with separate tables of their gallery indices and files.
+ * Each query is then scored against the whole buffer in a single call.
+ * For floating point buffers and distances implementing br::Distance::compareProducts the squared norms of the packed
+ * rows are computed once, so each query costs one matrix multiply.
+ * The remaining templates are passed to br::Distance::prepareTargets once the gallery is loaded.
  * \author Charles Otto \cite caotto
  */
 class GalleryCompareTransform : public Transform
@@ -31,42 +38,201 @@ class GalleryCompareTransform : public Transform
     Q_OBJECT
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED true)
     Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(bool packed READ get_packed WRITE set_packed RESET reset_packed STORED false)
     BR_PROPERTY(br::Distance*, distance, NULL)
     BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(bool, packed, true)
 
+    // Templates compared individually, all of them unless the gallery is packed
     TemplateList gallery;
+    QVector<int> galleryIds;
+
+    // Packed templates, one row per template
+    cv::Mat arena, arenaBuffer, arenaNorms;
+    QVector<int> arenaIds;
+    FileList arenaFiles;
+    int matRows, matCols, matType;
+
+    int size() const
+    {
+        return gallery.size() + arenaIds.size();
+    }
+
+    bool matches(const cv::Mat &m) const
+    {
+        return (m.rows == matRows) && (m.cols == matCols) && (m.type() == matType);
+    }
 
     void project(const Template &src, Template &dst) const
     {
         dst = src;
-        if (gallery.isEmpty())
+        if (size() == 0)
+            return;
+
+        if (arena.empty()) {
+            QList<float> line = distance->compare(gallery, src);
+            dst.m() = OpenCVUtils::toMat(line, 1);
+            return;
+        }
+
+        cv::Mat line(1, size(), CV_32FC1);
+        float *scores = line.ptr<float>();
+
+        cv::Mat batch;
+        if ((src.size() == 1) && matches(src.first()) && score((src.first().isContinuous() ? src.first() : src.first().clone()).reshape(1, 1), batch)) {
+            const float *batchScores = batch.ptr<float>();
+            for (int i=0; i<arenaIds.size(); i++)
+                scores[arenaIds[i]] = batchScores[i];
+            for (int i=0; i<gallery.size(); i++)
+                scores[galleryIds[i]] = distance->compare(gallery[i], src);
+        } else {
+            const QList<float> fallback = distance->compare(unpack(), src);
+            for (int i=0; i<fallback.size(); i++)
+                scores[i] = fallback[i];
+        }
+
+        dst.m() = line;
+    }
+
+    // Score one query row against the arena, reusing the cached norms when there are any
+    bool score(const cv::Mat &query, cv::Mat &scores) const
+    {
+        if (arenaNorms.empty())
+            return distance->compareBatch(arena, query, scores);
+
+        cv::gemm(query, arena, 1, cv::Mat(), 0, scores, cv::GEMM_2_T);
+        const cv::Mat queryNorm(1, 1, CV_32FC1, cv::Scalar(query.dot(query)));
+        return distance->compareProducts(scores, arenaNorms, queryNorm, scores);
+    }
+
+    // Pack the gallery, then let the distance index the templates it will compare individually
+    void prepare()
+    {
+        pack();
+        if (distance)
+            distance->prepareTargets(gallery);
+    }
+
+    // Pack the single-matrix templates matching the shape of the first one
+    void pack()
+    {
+        arena.release();
+        arenaBuffer.release();
+        arenaNorms.release();
+        arenaIds.clear();
+        arenaFiles.clear();
+        galleryIds.clear();
+        if (!packed || !distance || !distance->batches() || gallery.isEmpty())
+            return;
+
+        int reference = -1;
+        for (int i=0; i<gallery.size(); i++)
+            if ((gallery[i].size() == 1) && gallery[i].first().data) {
+                reference = i;
+                break;
+            }
+        if (reference == -1)
+            return;
+
+        const cv::Mat &m = gallery[reference].first();
+        matRows = m.rows;
+        matCols = m.cols;
+        matType = m.type();
+
+        QVector<int> candidates;
+        for (int i=0; i<gallery.size(); i++)
+            if ((gallery[i].size() == 1) && gallery[i].first().data && matches(gallery[i].first()))
+                candidates.append(i);
+
+        // Rows are padded to a multiple of the cache line size and the buffer starts on a cache line
+        static const int alignment = 64;
+        const size_t rowBytes = m.total() * m.elemSize();
+        const size_t stride = cv::alignSize(rowBytes, alignment);
+        arenaBuffer.create(1, int(candidates.size() * stride + alignment), CV_8UC1);
+        arenaBuffer.setTo(0);
+        arena = cv::Mat(candidates.size(), int(m.total() * m.channels()), m.depth(), cv::alignPtr(arenaBuffer.data, alignment), stride);
+
+        for (int i=0; i<candidates.size(); i++) {
+            const cv::Mat &src = gallery[candidates[i]].first();
+            if (src.isContinuous()) memcpy(arena.ptr(i), src.data, rowBytes);
+            else                    memcpy(arena.ptr(i), src.clone().data, rowBytes);
+        }
+
+        // Only keep the packed representation if the distance can use it
+        cv::Mat scores;
+        if (!distance->compareBatch(arena.rowRange(0, 1), arena.rowRange(0, 1), scores)) {
+            arena.release();
+            arenaBuffer.release();
             return;
+        }
+
+        // Floating point rows only need their norms computed once if the distance scores from inner products
+        if (arena.type() == CV_32FC1) {
+            arenaNorms.create(1, arena.rows, CV_32FC1);
+            for (int i=0; i<arena.rows; i++)
+                arenaNorms.at<float>(i) = float(arena.row(i).dot(arena.row(i)));
+            cv::Mat products;
+            cv::gemm(arena.rowRange(0, 1), arena.rowRange(0, 1), 1, cv::Mat(), 0, products, cv::GEMM_2_T);
+            if (!distance->compareProducts(products, arenaNorms.colRange(0, 1), arenaNorms.colRange(0, 1), products))
+                arenaNorms.release();
+        }
+
+        arenaIds = candidates;
+        foreach (int i, candidates)
+            arenaFiles.append(gallery[i].file);
+        TemplateList remaining;
+        for (int i=0, j=0; i<gallery.size(); i++) {
+            if ((j < candidates.size()) && (candidates[j] == i)) {
+                j++;
+                continue;
+            }
+            remaining.append(gallery[i]);
+            galleryIds.append(i);
+        }
+        gallery = remaining;
+    }
+
+    // Reconstruct the gallery templates, sharing the packed data
+    TemplateList unpack() const
+    {
+        if (arena.empty())
+            return gallery;
 
-        QList<float> line = distance->compare(gallery, src);
-        dst.m() = OpenCVUtils::toMat(line, 1);
+        TemplateList templates;
+        for (int i=0; i<size(); i++)
+            templates.append(Template());
+        for (int i=0; i<arenaIds.size(); i++)
+            templates[arenaIds[i]] = Template(arenaFiles[i], cv::Mat(matRows, matCols, matType, (void*)arena.ptr(i)));
+        for (int i=0; i<gallery.size(); i++)
+            templates[galleryIds[i]] = gallery[i];
+        return templates;
     }
 
     void init()
     {
-        if (!galleryName.isEmpty())
+        if (!galleryName.isEmpty()) {
             gallery = TemplateList::fromGallery(galleryName);
+            prepare();
+        }
     }
 
     void train(const TemplateList &data)
     {
         gallery = data;
+        prepare();
     }
 
     void store(QDataStream &stream) const
     {
         br::Object::store(stream);
-        stream << gallery;
+        stream << unpack();
     }
 
     void load(QDataStream &stream)
     {
         br::Object::load(stream);
         stream >> gallery;
+        prepare();
     }
 
 public:
@@ -0,0 +1,170 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <algorithm>
+#include <vector>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/ivf.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Approximate counterpart of GalleryCompareTransform searching an inverted file index (with name = galleryName).
+ * dst will contain a 1 by n vector of scores.
+ *
+ * Only the gallery templates in the nprobe lists nearest the query are scored with the distance,
+ * the remaining scores are the lowest representable value.
+ * Each list is packed into a single matrix so that distances supporting br::Distance::compareBatch score it in one call.
+ * Every n-th query, where n = recall, is also compared exhaustively to measure the recall of the index,
+ * the fraction of the recallRank best exhaustive matches that the index also ranks in its top recallRank.
+ */
+class IVFCompareTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(int nprobe READ get_nprobe WRITE set_nprobe RESET reset_nprobe STORED false)
+    Q_PROPERTY(int recall READ get_recall WRITE set_recall RESET reset_recall STORED false)
+    Q_PROPERTY(int recallRank READ get_recallRank WRITE set_recallRank RESET reset_recallRank STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(int, nprobe, 8)
+    BR_PROPERTY(int, recall, 0)
+    BR_PROPERTY(int, recallRank, 10)
+
+    InvertedFile index;
+    QVector<cv::Mat> packedLists;
+
+    mutable QAtomicInt queries, sampled, expected, found;
+
+    ~IVFCompareTransform()
+    {
+        if (expected.load() > 0)
+            qDebug("IVF recall@%d = %.4f over %d sampled queries with nprobe = %d", recallRank,
+                   float(found.load()) / expected.load(), sampled.load(), nprobe);
+    }
+
+    void init()
+    {
+        if (galleryName.isEmpty())
+            return;
+
+        index.load(galleryName);
+        index.setProbes(nprobe);
+
+        // Pack each list and point its templates at the packed rows
+        packedLists = QVector<cv::Mat>(index.lists.size());
+        for (int i=0; i<index.lists.size(); i++) {
+            const QVector<int> &list = index.lists[i];
+            TemplateList templates;
+            foreach (int id, list)
+                templates.append(index.templates[id]);
+
+            cv::Mat packed;
+            if (!templates.pack(packed))
+                continue;
+            for (int j=0; j<list.size(); j++) {
+                const cv::Mat &m = templates[j].first();
+                index.templates[list[j]] = Template(File(), cv::Mat(m.rows, m.cols, m.type(), packed.ptr(j)));
+            }
+            packedLists[i] = packed;
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        if (index.templates.isEmpty())
+            return;
+
+        cv::Mat line(1, index.templates.size(), CV_32FC1, cv::Scalar(-std::numeric_limits<float>::max()));
+        float *scores = line.ptr<float>();
+
+        cv::Mat query;
+        if (index.indexable(src))
+            query = (src.first().isContinuous() ? src.first() : src.first().clone()).reshape(1, 1);
+
+        foreach (int list, index.probe(src)) {
+            const QVector<int> &ids = index.lists[list];
+            cv::Mat batch;
+            if (!packedLists[list].empty() && distance->compareBatch(packedLists[list], query, batch)) {
+                const float *batchScores = batch.ptr<float>();
+                for (int i=0; i<ids.size(); i++)
+                    scores[ids[i]] = batchScores[i];
+            } else {
+                foreach (int id, ids)
+                    scores[id] = distance->compare(index.templates[id], src);
+            }
+        }
+
+        foreach (int id, index.unindexed)
+            scores[id] = distance->compare(index.templates[id], src);
+
+        if ((recall > 0) && (queries.fetchAndAddRelaxed(1) % recall == 0))
+            measureRecall(src, scores);
+
+        dst.m() = line;
+    }
+
+    void measureRecall(const Template &src, const float *scores) const
+    {
+        const QList<float> exhaustive = distance->compare(index.templates, src);
+        const std::vector<int> truth = best(exhaustive.toVector().constData(), exhaustive.size());
+        const std::vector<int> approximate = best(scores, index.templates.size());
+
+        int hits = 0;
+        foreach (int id, truth)
+            hits += std::binary_search(approximate.begin(), approximate.end(), id) ? 1 : 0;
+
+        found.fetchAndAddRelaxed(hits);
+        expected.fetchAndAddRelaxed(int(truth.size()));
+        sampled.fetchAndAddRelaxed(1);
+    }
+
+    // Sorted indices of the recallRank highest scores
+    std::vector<int> best(const float *scores, int size) const
+    {
+        std::vector<int> ids(size);
+        for (int i=0; i<size; i++)
+            ids[i] = i;
+
+        const int k = std::min(recallRank, size);
+        std::nth_element(ids.begin(), ids.begin() + k, ids.end(), ScoreGreater(scores));
+        ids.resize(k);
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    struct ScoreGreater
+    {
+        const float *scores;
+        explicit ScoreGreater(const float *scores) : scores(scores) {}
+        bool operator()(int a, int b) const { return (scores[a] > scores[b]) || ((scores[a] == scores[b]) && (a < b)); }
+    };
+
+public:
+    IVFCompareTransform() : Transform(false, false) {}
+};
+
+BR_REGISTER(Transform, IVFCompareTransform)
+
+} // namespace br
+
+#include "core/ivfcompare.moc"
@@ -0,0 +1,214 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+#include <vector>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+#include <openbr/core/opencvutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Approximate counterpart of GalleryCompareTransform scanning an 8-bit quantized copy of a gallery (with name = galleryName).
+ * dst will contain a 1 by n vector of scores.
+ *
+ * Each dimension of the gallery is quantized to 8 bits with its own offset and scale.
+ * Queries are folded into 16-bit weights over the codes, so that the inner product with every
+ * reconstructed gallery template is a single integer dot product, and br::Distance::compareProducts turns these into approximate scores.
+ * The rerank best templates are then scored exactly and the rest are reported as -FLT_MAX, as IVFCompareTransform does,
+ * so approximate scores never appear in the output.
+ * Only gallery templates holding one \c CV_32FC1 matrix of the same size as the first such template are quantized, the rest are always compared exactly.
+ * If the distance doesn't implement br::Distance::compareProducts every template is compared exactly.
+ *
+ * The gallery templates are kept as loaded, metadata included, for re-ranking,
+ * so the codes add a quarter of the size of the float gallery to its resident memory rather than replacing it.
+ */
+class QuantizedCompareTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(int rerank READ get_rerank WRITE set_rerank RESET reset_rerank STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(int, rerank, 100)
+
+    // Exact templates for re-ranking
+    TemplateList gallery;
+
+    // One row of codes per quantized template, reconstructed as offsets + scales * codes
+    cv::Mat codes, offsets, scales;
+    cv::Mat norms; // Squared norm of each reconstructed template
+    QVector<int> codeIds; // Gallery index of each row of codes
+    QVector<int> exactIds; // Gallery indices of the templates that aren't quantized
+
+    void init()
+    {
+        if (galleryName.isEmpty())
+            return;
+
+        gallery = TemplateList::fromGallery(galleryName);
+        quantize();
+    }
+
+    static bool quantizable(const Template &t)
+    {
+        return (t.size() == 1) && t.first().data && (t.first().type() == CV_32FC1);
+    }
+
+    static cv::Mat continuous(const cv::Mat &m)
+    {
+        return m.isContinuous() ? m : m.clone();
+    }
+
+    void quantize()
+    {
+        codes.release();
+        codeIds.clear();
+        exactIds.clear();
+
+        cv::Mat scores, norm(1, 1, CV_32FC1, cv::Scalar(0));
+        if (!distance->compareProducts(norm, norm, norm, scores)) {
+            qWarning("%s does not implement compareProducts, comparing exactly.", distance->metaObject()->className());
+            return;
+        }
+
+        int reference = -1;
+        for (int i=0; (i<gallery.size()) && (reference == -1); i++)
+            if (quantizable(gallery[i]))
+                reference = i;
+        if (reference == -1) {
+            qWarning("QuantizedCompare requires single-matrix CV_32FC1 templates, comparing exactly.");
+            return;
+        }
+
+        const cv::Mat &m = gallery[reference].first();
+        for (int i=0; i<gallery.size(); i++) {
+            if (quantizable(gallery[i]) && (gallery[i].first().rows == m.rows) && (gallery[i].first().cols == m.cols)) codeIds.append(i);
+            else                                                                                                          exactIds.append(i);
+        }
+        if (!exactIds.isEmpty())
+            qWarning("QuantizedCompare compares %d templates that don't match the size of the rest exactly.", exactIds.size());
+
+        const int dimensions = int(m.total());
+        offsets = cv::Mat(1, dimensions, CV_32FC1, cv::Scalar(std::numeric_limits<float>::max()));
+        cv::Mat maxima(1, dimensions, CV_32FC1, cv::Scalar(-std::numeric_limits<float>::max()));
+        foreach (int id, codeIds) {
+            const cv::Mat row = continuous(gallery[id].first()).reshape(1, 1);
+            offsets = cv::min(offsets, row);
+            maxima = cv::max(maxima, row);
+        }
+        scales = (maxima - offsets) / 255;
+
+        const float *offset = offsets.ptr<float>();
+        const float *scale = scales.ptr<float>();
+        codes.create(codeIds.size(), dimensions, CV_8UC1);
+        norms.create(1, codeIds.size(), CV_32FC1);
+        for (int i=0; i<codeIds.size(); i++) {
+            const cv::Mat data = continuous(gallery[codeIds[i]].first());
+            const float *row = data.ptr<float>();
+            uchar *code = codes.ptr(i);
+            double squaredNorm = 0;
+            for (int j=0; j<dimensions; j++) {
+                code[j] = (scale[j] > 0) ? cv::saturate_cast<uchar>((row[j] - offset[j]) / scale[j]) : 0;
+                const double reconstructed = offset[j] + scale[j] * code[j];
+                squaredNorm += reconstructed * reconstructed;
+            }
+            norms.at<float>(i) = squaredNorm;
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        if (gallery.isEmpty())
+            return;
+
+        if (codes.empty() || (src.size() != 1) || (src.first().type() != CV_32FC1) || (int(src.first().total()) != codes.cols)) {
+            dst.m() = OpenCVUtils::toMat(distance->compare(gallery, src), 1);
+            return;
+        }
+
+        const cv::Mat query = src.first().isContinuous() ? src.first() : src.first().clone();
+        const float *value = query.ptr<float>();
+        const float *offset = offsets.ptr<float>();
+        const float *scale = scales.ptr<float>();
+        const int dimensions = codes.cols;
+
+        // The inner product with a reconstructed template is the constant part plus the scaled query dotted with its codes
+        std::vector<float> scaled(dimensions);
+        double constant = 0, squaredNorm = 0;
+        float largest = 0;
+        for (int j=0; j<dimensions; j++) {
+            scaled[j] = value[j] * scale[j];
+            constant += double(value[j]) * offset[j];
+            squaredNorm += double(value[j]) * value[j];
+            largest = std::max(largest, std::abs(scaled[j]));
+        }
+
+        const double unit = (largest > 0) ? largest / 32767.0 : 1;
+        std::vector<short> weights(dimensions);
+        for (int j=0; j<dimensions; j++)
+            weights[j] = short(cvRound(scaled[j] / unit));
+
+        cv::Mat approximate(1, codes.rows, CV_32FC1);
+        float *scores = approximate.ptr<float>();
+        for (int i=0; i<codes.rows; i++)
+            scores[i] = constant + unit * dot_u8(weights.data(), codes.ptr(i), dimensions);
+
+        const cv::Mat queryNorm(1, 1, CV_32FC1, cv::Scalar(squaredNorm));
+        if (!distance->compareProducts(approximate, norms, queryNorm, approximate)) {
+            dst.m() = OpenCVUtils::toMat(distance->compare(gallery, src), 1);
+            return;
+        }
+
+        // Re-score the best candidates exactly, the rest only have approximate scores
+        const int candidates = std::max(0, std::min(rerank, codes.rows));
+        std::vector<int> ids(codes.rows);
+        for (int i=0; i<codes.rows; i++)
+            ids[i] = i;
+        if (candidates > 0)
+            std::nth_element(ids.begin(), ids.begin() + (candidates-1), ids.end(), ScoreGreater(scores));
+
+        cv::Mat line(1, gallery.size(), CV_32FC1, cv::Scalar(-std::numeric_limits<float>::max()));
+        for (int i=0; i<candidates; i++)
+            line.at<float>(codeIds[ids[i]]) = distance->compare(gallery[codeIds[ids[i]]], src);
+        foreach (int id, exactIds)
+            line.at<float>(id) = distance->compare(gallery[id], src);
+
+        dst.m() = line;
+    }
+
+    struct ScoreGreater
+    {
+        const float *scores;
+        explicit ScoreGreater(const float *scores) : scores(scores) {}
+        bool operator()(int a, int b) const { return (scores[a] > scores[b]) || ((scores[a] == scores[b]) && (a < b)); }
+    };
+
+public:
+    QuantizedCompareTransform() : Transform(false, false) {}
+};
+
+BR_REGISTER(Transform, QuantizedCompareTransform)
+
+} // namespace br
+
+#include "core/quantizedcompare.moc"
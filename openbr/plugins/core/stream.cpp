@@ -15,13 +15,21 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
+#include <QElapsedTimer>
+#include <QFileInfo>
 #include <QReadWriteLock>
 #include <QWaitCondition>
-#include <QThreadPool>
+#include <QThreadStorage>
 #include <QSemaphore>
-#include <QMap>
 #include <QQueue>
+#include <QScopedArrayPointer>
+#include <QSet>
+#include <QThread>
 #include <QtConcurrent>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif // __linux__
 #include <opencv/highgui.h>
 #include <opencv2/highgui/highgui.hpp>
 
@@ -41,6 +49,53 @@ class FrameData
 public:
     int sequenceNumber;
     TemplateList data;
+
+    qint64 issued; // When the frame was read, in nanoseconds of DataSource::clock
+    qint64 bytes; // The most matrix data the frame has held so far
+
+    // Matrices sharing a buffer, such as regions of one decoded frame, count it once
+    void updateBytes()
+    {
+        QSet<const uchar *> buffers;
+        qint64 current = 0;
+        foreach (const Template &t, data)
+            foreach (const cv::Mat &m, t)
+                if (m.datastart && !buffers.contains(m.datastart)) {
+                    buffers.insert(m.datastart);
+                    current += m.dataend - m.datastart;
+                }
+        bytes = std::max(bytes, current);
+    }
+
+    // A FrameData may carry a batch of consecutive frames, in which case frames holds
+    // the number of templates in each of them, otherwise frames is empty.
+    QList<int> frames;
+
+    QList<TemplateList> split() const
+    {
+        QList<TemplateList> output;
+        if (frames.isEmpty()) {
+            output.append(data);
+            return output;
+        }
+
+        int offset = 0;
+        foreach (int size, frames) {
+            output.append(data.mid(offset, size));
+            offset += size;
+        }
+        return output;
+    }
+
+    void join(const QList<TemplateList> &batch)
+    {
+        data.clear();
+        frames.clear();
+        foreach (const TemplateList &frame, batch) {
+            data.append(frame);
+            frames.append(frame.size());
+        }
+    }
 };
 
 // A buffer shared between adjacent processing stages in a stream
@@ -59,119 +114,101 @@ public:
 
 // for n - 1 boundaries, multiple threads call addItem, the frames are
 // sequenced based on FrameData::sequence_number, and calls to getItem
-// receive them in that order
+// receive them in that order. Frames are returned to the data source in
+// sequence, so the frames in flight always have consecutive sequence numbers
+// and each one has its own slot in a ring with room for every frame.
 class SequencingBuffer : public SharedBuffer
 {
 public:
-    SequencingBuffer()
+    SequencingBuffer(int capacity) : slots(new QAtomicPointer<FrameData>[capacity])
     {
+        this->capacity = capacity;
         next_target = 0;
     }
 
     void addItem(FrameData *input)
     {
-        QMutexLocker bufferLock(&bufferGuard);
-
-        buffer.insert(input->sequenceNumber, input);
+        if (!slots[input->sequenceNumber % capacity].testAndSetRelease(NULL, input))
+            qFatal("sequencing buffer overflow!");
+        items.ref();
     }
 
+    // Only called by one thread at a time
     FrameData *tryGetItem()
     {
-        QMutexLocker bufferLock(&bufferGuard);
-
-        if (buffer.empty() || buffer.begin().key() != this->next_target) {
+        QAtomicPointer<FrameData> &slot = slots[next_target % capacity];
+        FrameData *output = slot.loadAcquire();
+        if (output == NULL)
             return NULL;
-        }
 
-        QMap<int, FrameData *>::Iterator result = buffer.begin();
-
-        if (next_target != result.value()->sequenceNumber) {
+        if (next_target != output->sequenceNumber) {
             qFatal("mismatched targets!");
         }
 
+        slot.store(NULL);
+        items.deref();
         next_target = next_target + 1;
-
-        FrameData *output = result.value();
-        buffer.erase(result);
         return output;
     }
 
     virtual int size()
     {
-        QMutexLocker lock(&bufferGuard);
-        return buffer.size();
+        return items.load();
     }
+
     virtual void reset()
     {
         if (size() != 0)
             qDebug("Sequencing buffer has non-zero size during reset!");
 
-        QMutexLocker lock(&bufferGuard);
         next_target = 0;
     }
 
-
 private:
-    QMutex bufferGuard;
+    QScopedArrayPointer<QAtomicPointer<FrameData> > slots;
+    int capacity;
     int next_target;
-
-    QMap<int, FrameData *> buffer;
+    QAtomicInt items;
 };
 
-// For 1 - 1 boundaries, a double buffering scheme
-// Producer/consumer read/write from separate buffers, and switch if their
-// buffer runs out/overflows. Synchronization is handled by a read/write lock
-// threads are "reading" if they are adding to/removing from their individual
-// buffer, and writing if they access or swap with the other buffer.
+// For 1 - 1 boundaries, a single producer single consumer ring. The producer
+// only writes tail and the consumer only writes head, so neither needs a lock.
+// Calls to addItem, and calls to tryGetItem, may come from different threads
+// as long as they don't overlap, which the stages ensure.
 class DoubleBuffer : public SharedBuffer
 {
 public:
-    DoubleBuffer()
+    DoubleBuffer(int capacity) : slots(new FrameData*[capacity+1])
     {
-        inputBuffer = &buffer1;
-        outputBuffer = &buffer2;
+        // One slot is always left empty to tell a full ring from an empty one
+        this->capacity = capacity + 1;
     }
 
     int size()
     {
-        QReadLocker readLock(&bufferGuard);
-        return inputBuffer->size() + outputBuffer->size();
+        return (tail.loadAcquire() - head.loadAcquire() + capacity) % capacity;
     }
 
     // called from the producer thread
     void addItem(FrameData *input)
     {
-        QReadLocker readLock(&bufferGuard);
-        inputBuffer->append(input);
+        const int current = tail.load();
+        const int next = (current + 1) % capacity;
+        if (next == head.loadAcquire())
+            qFatal("shared buffer overflow!");
+
+        slots[current] = input;
+        tail.storeRelease(next);
     }
 
     FrameData *tryGetItem()
     {
-        QReadLocker readLock(&bufferGuard);
-
-        // There is something for us to get
-        if (!outputBuffer->empty()) {
-            FrameData *output = outputBuffer->first();
-            outputBuffer->removeFirst();
-            return output;
-        }
-
-        // Outputbuffer is empty, try to swap with the input buffer, we need a
-        // write lock to do that.
-        readLock.unlock();
-        QWriteLocker writeLock(&bufferGuard);
-
-        // Nothing on the input buffer either?
-        if (inputBuffer->empty()) {
+        const int current = head.load();
+        if (current == tail.loadAcquire())
             return NULL;
-        }
 
-        // input buffer is non-empty, so swap the buffers
-        std::swap(inputBuffer, outputBuffer);
-
-        // Return a frame
-        FrameData *output = outputBuffer->first();
-        outputBuffer->removeFirst();
+        FrameData *output = slots[current];
+        head.storeRelease((current + 1) % capacity);
         return output;
     }
 
@@ -181,29 +218,135 @@ public:
             qDebug("Shared buffer has non-zero size during reset!");
     }
 
+private:
+    QScopedArrayPointer<FrameData *> slots;
+    int capacity;
+
+    // The next slot to read, and the next slot to write
+    QAtomicInt head;
+    QAtomicInt tail;
+};
+
+// Reads the blocks of a gallery on its own thread, staying up to prefetch blocks
+// ahead of the reader so that the stream isn't held up by disk reads and decoding.
+class GalleryPrefetcher : public QThread
+{
+public:
+    GalleryPrefetcher(const QSharedPointer<Gallery> &gallery, const QString &fileName, qint64 blockBytes, int prefetch)
+        : gallery(gallery), blockBytes(blockBytes), prefetch(std::max(1, prefetch)), finished(false), stopping(false)
+    {
+        // Blocks are sized in bytes for galleries read straight from a file, where
+        // position() is a byte offset. Others are read in blocks of 100 templates.
+        const QFileInfo info(fileName);
+        sized = (blockBytes > 0) && info.isFile() && (gallery->totalSize() == info.size());
+        gallery->readBlockSize = sized ? 16 : 100;
+
+#ifdef __linux__
+        descriptor = sized ? ::open(QFile::encodeName(info.absoluteFilePath()).constData(), O_RDONLY) : -1;
+#endif // __linux__
+    }
+
+    ~GalleryPrefetcher()
+    {
+        stop();
+#ifdef __linux__
+        if (descriptor >= 0)
+            ::close(descriptor);
+#endif // __linux__
+    }
+
+    void stop()
+    {
+        QMutexLocker locker(&lock);
+        stopping = true;
+        changed.wakeAll();
+        locker.unlock();
+        wait();
+    }
+
+    // Returns false once the gallery has no more blocks
+    bool take(TemplateList &block)
+    {
+        QMutexLocker locker(&lock);
+        while (blocks.isEmpty() && !finished)
+            changed.wait(&lock);
+
+        if (blocks.isEmpty())
+            return false;
+
+        block = blocks.dequeue();
+        changed.wakeAll();
+        return true;
+    }
+
+protected:
+    void run()
+    {
+        qint64 offset = gallery->position();
+        bool last = false;
+        while (!last) {
+            QMutexLocker locker(&lock);
+            while ((blocks.size() >= prefetch) && !stopping)
+                changed.wait(&lock);
+            if (stopping)
+                return;
+            locker.unlock();
+
+            // Ask the OS to start reading the blocks after this one while it is decoded
+            if (sized)
+                readAhead(offset, prefetch * blockBytes);
+
+            TemplateList block = gallery->readBlock(&last);
+
+            if (sized && !block.isEmpty()) {
+                const qint64 position = gallery->position();
+                const qint64 templateBytes = std::max(qint64(1), (position - offset) / block.size());
+                gallery->readBlockSize = int(std::max(qint64(1), std::min(qint64(std::numeric_limits<int>::max()), blockBytes / templateBytes)));
+                offset = position;
+            }
+
+            locker.relock();
+            blocks.enqueue(block);
+            finished = last;
+            changed.wakeAll();
+        }
+    }
 
 private:
-    // The read-write lock. The thread adding to this buffer can add
-    // to the current input buffer if it has a read lock. The thread
-    // removing from this buffer can remove things from the current
-    // output buffer if it has a read lock, or swap the buffers if it
-    // has a write lock.
-    QReadWriteLock bufferGuard;
-
-    // The buffer that is currently being added to
-    QList<FrameData *> * inputBuffer;
-    // The buffer that is currently being removed from
-    QList<FrameData *> * outputBuffer;
-
-    // The buffers pointed at by inputBuffer/outputBuffer
-    QList<FrameData *> buffer1;
-    QList<FrameData *> buffer2;
+    QSharedPointer<Gallery> gallery;
+    qint64 blockBytes;
+    int prefetch;
+    bool sized;
+#ifdef __linux__
+    int descriptor;
+#endif // __linux__
+
+    QMutex lock;
+    QWaitCondition changed;
+    QQueue<TemplateList> blocks;
+    bool finished, stopping;
+
+    void readAhead(qint64 offset, qint64 length)
+    {
+#ifdef __linux__
+        if (descriptor >= 0)
+            posix_fadvise(descriptor, offset, length, POSIX_FADV_WILLNEED);
+#else
+        (void) offset; (void) length;
+#endif // __linux__
+    }
 };
 
 // Given a template as input, open the file contained as a gallery, and return templates one at a time on
 // calls to getNextTemplate
 struct StreamGallery
 {
+    StreamGallery() : blockBytes(qint64(4) << 20), prefetch(2) {}
+
+    // Blocks of about blockBytes bytes are read prefetch blocks ahead on a separate thread
+    qint64 blockBytes;
+    int prefetch;
+
     bool open(Template &input)
     {
         // Create a gallery
@@ -217,9 +360,9 @@ struct StreamGallery
 
         // Set up state variables for future reads
         galleryOk = true;
-        gallery->readBlockSize = 100;
         nextIdx = 0;
-        lastBlock = false;
+        reader.reset(new GalleryPrefetcher(gallery, input.file.name, blockBytes, prefetch));
+        reader->start();
         return galleryOk;
     }
 
@@ -228,17 +371,22 @@ struct StreamGallery
     void close()
     {
         galleryOk = false;
+        reader.reset();
+        gallery.clear();
         currentData.clear();
         nextIdx = 0;
-        lastBlock = true;
     }
 
     bool getNextTemplate(Template &output)
     {
         // If we still have data available, we return one of those
-        if ((nextIdx >= currentData.size()) && !lastBlock) {
-            currentData = gallery->readBlock(&lastBlock);
+        while ((nextIdx >= currentData.size()) && reader) {
             nextIdx = 0;
+            if (!reader->take(currentData)) {
+                // The final block was already consumed, don't replay it
+                currentData.clear();
+                reader.reset();
+            }
         }
 
         if (nextIdx >= currentData.size()) {
@@ -254,8 +402,8 @@ struct StreamGallery
 protected:
 
     QSharedPointer<Gallery> gallery;
+    QScopedPointer<GalleryPrefetcher> reader;
     bool galleryOk;
-    bool lastBlock;
 
     TemplateList currentData;
     int nextIdx;
@@ -267,7 +415,7 @@ protected:
 class DataSource
 {
 public:
-    DataSource(int maxFrames=500)
+    DataSource(int maxFrames=500) : allFrames(maxFrames)
     {
         // The sequence number of the last frame
         final_frame = -1;
@@ -275,6 +423,62 @@ public:
         {
             allFrames.addItem(new FrameData());
         }
+
+        batchSize = 1;
+        maxBatchDelay = -1;
+        readTime = 0;
+
+        this->maxFrames = maxFrames;
+        minFrames = std::min(maxFrames, std::max(2, 2*Globals->parallelism));
+        configure(0, false);
+        clock.start();
+    }
+
+    // Frames are only read while fewer than the frame budget are in flight and the frames
+    // in flight are estimated to hold less than byteBudget bytes of matrices (if positive).
+    // An adaptive frame budget starts small and is resized as frames are returned, otherwise
+    // it is the number of frames in the pool.
+    void configure(qint64 byteBudget, bool adaptive)
+    {
+        this->byteBudget = byteBudget;
+        this->adaptive = adaptive;
+        frameBudget = adaptive ? minFrames : maxFrames;
+        frameBytes = frameLatency = throughput = 0;
+        previousLatency = previousThroughput = 0;
+        windowFrames = 0;
+        windowStart = 0;
+        peakFrames = 0;
+        updateLimit();
+    }
+
+    // The stage input buffers, the frames waiting in them tell the budget it is larger than it needs to be
+    QList<SharedBuffer *> queues;
+
+    // Up to batchSize consecutive frames are read into each FrameData. If maxBatchDelay is
+    // non-negative a batch is closed rather than reading another frame once that read would be
+    // expected to end more than maxBatchDelay milliseconds after the first frame arrived. Reads
+    // block and can't be interrupted, so a read slower than its average may still overrun.
+    int batchSize;
+    int maxBatchDelay;
+
+    // Gallery blocks of about blockBytes bytes are read up to prefetch blocks ahead of the stream
+    void configureReads(qint64 blockBytes, int prefetch)
+    {
+        frameSource.blockBytes = blockBytes;
+        frameSource.prefetch = prefetch;
+    }
+
+    // The most frames currently admitted at once
+    int budget() const
+    {
+        return limit.load();
+    }
+
+    QString stats() const
+    {
+        return QString("Stream budget: %1 of %2 frames, %3 frames in flight at most, %4 MB per frame, latency %5 ms, %6 frames per second")
+                .arg(QString::number(limit.load()), QString::number(maxFrames), QString::number(peakFrames),
+                     QString::number(frameBytes / (1 << 20), 'f', 2), QString::number(frameLatency * 1000, 'f', 2), QString::number(throughput, 'f', 1));
     }
 
     virtual ~DataSource()
@@ -311,6 +515,7 @@ public:
         final_frame = -1;
         // Start our sequence numbers from the input index
         next_sequence_number = 0;
+        next_frame_number = 0;
 
         // Actually open the data source
         bool open_res = openNextTemplate();
@@ -336,21 +541,32 @@ public:
             return NULL;
         }
 
+        // Is the budget spent? There is always room for one frame.
+        const int active = inFlight.load();
+        if ((active > 0) && (active >= limit.load())) {
+            starved.store(1);
+            return NULL;
+        }
+
         // Try to get a FrameData from the pool, if we can't it means too many
         // frames are already out, and we will return NULL to indicate failure
         FrameData *aFrame = allFrames.tryGetItem();
         if (aFrame == NULL)
             return NULL;
+        peakFrames = std::max(peakFrames, inFlight.fetchAndAddOrdered(1) + 1);
 
         // Try to actually read a frame, if this returns false the data source is broken
         bool res = getNextFrame(*aFrame);
+        aFrame->issued = clock.nsecsElapsed();
+        aFrame->bytes = 0;
+        aFrame->updateBytes();
 
-        // The datasource broke, update final_frame
+        // The datasource broke, update final_frame. The final frame is empty
+        // unless it is a batch that was cut short.
         if (!res)
         {
             QMutexLocker lock(&last_frame_update);
             final_frame = aFrame->sequenceNumber;
-            aFrame->data().clear();
         }
 
         // If this is the last frame, say so
@@ -368,9 +584,12 @@ public:
     {
         int frameNumber = inputFrame->sequenceNumber;
 
+        measure(*inputFrame);
         inputFrame->data.clear();
+        inputFrame->frames.clear();
         inputFrame->sequenceNumber = -1;
         allFrames.addItem(inputFrame);
+        inFlight.deref();
 
         bool rval = false;
 
@@ -390,6 +609,12 @@ public:
         lastReturned.wakeAll();
     }
 
+    bool isLastReturned()
+    {
+        QMutexLocker lock(&last_frame_update);
+        return allReturned;
+    }
+
     bool waitLast()
     {
         QMutexLocker lock(&last_frame_update);
@@ -428,26 +653,50 @@ protected:
         return true;
     }
 
+    // Read the next batch of frames, returns false if the data source ran out first
     bool getNextFrame(FrameData &output)
     {
-        bool got_frame = false;
+        output.sequenceNumber = next_sequence_number;
+
+        QElapsedTimer wait, read;
+        for (int i=0; i < batchSize; i++)
+        {
+            // Check the deadline before blocking on the next frame
+            if ((i > 0) && (maxBatchDelay >= 0) && (wait.nsecsElapsed() + readTime > qint64(maxBatchDelay) * 1000000))
+                break;
+
+            Template aTemplate;
+            read.start();
+            if (!getNextTemplate(aTemplate))
+                return false;
+            if (batchSize > 1)
+                readTime = (readTime * 7 + read.nsecsElapsed()) / 8;
 
-        Template aTemplate;
+            // set the frame number in the template's metadata
+            aTemplate.file.set("FrameNumber", next_frame_number++);
+            output.data.append(aTemplate);
+            if (batchSize > 1)
+                output.frames.append(1);
+
+            if (i == 0)
+                wait.start();
+        }
+
+        next_sequence_number++;
+        return true;
+    }
+
+    bool getNextTemplate(Template &output)
+    {
+        bool got_frame = false;
 
         while (!got_frame)
         {
-            got_frame = frameSource.getNextTemplate(aTemplate);
+            got_frame = frameSource.getNextTemplate(output);
 
             // OK we got a frame
-            if (got_frame) {
-                // set the sequence number and tempalte of this frame
-                output.sequenceNumber = next_sequence_number;
-                output.data.append(aTemplate);
-                // set the frame number in the template's metadata
-                output.data.last().file.set("FrameNumber", output.sequenceNumber);
-                next_sequence_number++;
+            if (got_frame)
                 return true;
-            }
 
             // advance to the next tempalte in our list
             this->current_template_idx++;
@@ -455,10 +704,8 @@ protected:
 
             // couldn't get the next template? nothing to do, otherwise we try to read
             // a frame at the top of this loop.
-            if (!open_res) {
-                output.sequenceNumber = next_sequence_number;
+            if (!open_res)
                 return false;
-            }
         }
 
         return false;
@@ -474,6 +721,8 @@ protected:
     StreamGallery frameSource;
 
     int next_sequence_number;
+    int next_frame_number;
+    qint64 readTime; // Moving average of nanoseconds per frame read, when batching
     int final_frame;
     bool is_broken;
     bool allReturned;
@@ -482,8 +731,257 @@ protected:
 
     QWaitCondition lastReturned;
     QMutex last_frame_update;
+
+    // Flow control, the measurements are only updated by returnFrame, which the end stage calls from one thread at a time
+    int maxFrames, minFrames, frameBudget, peakFrames;
+    qint64 byteBudget;
+    bool adaptive;
+    QAtomicInt inFlight, limit, starved;
+
+    QElapsedTimer clock;
+    double frameBytes, frameLatency, throughput; // Moving averages of the most bytes a frame held, and of seconds in flight
+    double previousLatency, previousThroughput;
+    int windowFrames;
+    qint64 windowStart;
+
+    void measure(const FrameData &frame)
+    {
+        const double latency = (clock.nsecsElapsed() - frame.issued) / 1e9;
+        frameLatency = (frameLatency > 0) ? 0.9*frameLatency + 0.1*latency : latency;
+        frameBytes = (frameBytes > 0) ? 0.9*frameBytes + 0.1*frame.bytes : frame.bytes;
+
+        // Revisit the budget once per budget's worth of frames
+        if (windowFrames++ == 0)
+            windowStart = frame.issued;
+        if (windowFrames < frameBudget) {
+            updateLimit();
+            return;
+        }
+
+        const qint64 now = clock.nsecsElapsed();
+        throughput = windowFrames / std::max(1e-9, (now - windowStart) / 1e9);
+        const bool held = starved.fetchAndStoreRelaxed(0) != 0;
+
+        if (adaptive) {
+            int queued = 0;
+            foreach (SharedBuffer *queue, queues)
+                queued += queue->size();
+
+            int budget = frameBudget;
+            // Frames are piling up in front of a single threaded stage, more of them would only wait
+            if (queued > std::max(1, Globals->parallelism))
+                budget -= budget / 4;
+            // The budget held frames back while more of them still paid off
+            else if (held && (throughput >= 0.95*previousThroughput) && ((previousLatency == 0) || (frameLatency < 1.5*previousLatency)))
+                budget += std::max(1, budget / 4);
+            // Latency grew without any more throughput for it
+            else if ((previousLatency > 0) && (frameLatency > 1.5*previousLatency) && (throughput <= 1.05*previousThroughput))
+                budget -= budget / 4;
+            frameBudget = std::min(maxFrames, std::max(minFrames, budget));
+        }
+
+        previousLatency = frameLatency;
+        previousThroughput = throughput;
+        windowFrames = 0;
+        updateLimit();
+    }
+
+    void updateLimit()
+    {
+        int frames = frameBudget;
+        if ((byteBudget > 0) && (frameBytes > 0))
+            frames = int(std::min(double(frames), std::max(1.0, byteBudget / frameBytes)));
+        limit.store(frames);
+    }
+};
+
+// Runs the work of every Stream in the process on Globals->parallelism threads.
+// Each worker has its own deque and runs the newest work it queued itself first, so a frame
+// tends to continue through consecutive stages on the same core. A worker whose deque is empty
+// steals the oldest work of the others. Work queued from other threads is dealt to the deques in turn.
+// A worker waiting on a nested stream keeps running that stream's queued work rather than blocking, see
+// DirectStreamTransform::projectUpdate, so every stream can share the same workers without deadlock.
+// The scheduler is sized by Globals->parallelism when the first Stream runs, later changes aren't picked up.
+class StreamScheduler
+{
+public:
+    StreamScheduler()
+    {
+        stopping = false;
+        sleeping = 0;
+        helping = 0;
+        const int count = std::max(1, Globals->parallelism);
+        for (int i=0; i<count; i++)
+            queues.append(new Queue());
+        for (int i=0; i<count; i++) {
+            workers.append(new Worker(this, i));
+            workers.last()->start();
+        }
+    }
+
+    ~StreamScheduler()
+    {
+        QMutexLocker lock(&idleLock);
+        stopping = true;
+        idle.wakeAll();
+        helpers.wakeAll();
+        lock.unlock();
+
+        foreach (Worker *worker, workers) {
+            worker->wait();
+            delete worker;
+        }
+        qDeleteAll(queues);
+    }
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    // Queue work on behalf of owner, which identifies the stream it belongs to
+    void start(QRunnable *runnable, const void *owner)
+    {
+        int index = currentWorker();
+        if (index < 0)
+            index = int(uint(dealt.fetchAndAddRelaxed(1)) % uint(queues.size()));
+
+        QMutexLocker queueLock(&queues[index]->lock);
+        queues[index]->work.append(Job(runnable, owner));
+        queueLock.unlock();
+        pending.ref();
+
+        QMutexLocker lock(&idleLock);
+        if (sleeping > 0)
+            idle.wakeOne();
+        if (helping > 0)
+            helpers.wakeAll();
+    }
+
+    bool isWorker() const
+    {
+        return currentWorker() >= 0;
+    }
+
+    // Run one piece of owner's queued work, or anyone's if owner is NULL, on the calling worker.
+    // Returns false if there was none.
+    bool runPending(const void *owner = NULL)
+    {
+        QRunnable *runnable = take(currentWorker(), owner);
+        if (!runnable)
+            return false;
+
+        runnable->run();
+        if (runnable->autoDelete())
+            delete runnable;
+        return true;
+    }
+
+    // Wait up to msecs for more work to be queued, for a worker helping with the work of one stream
+    void helpWait(unsigned long msecs)
+    {
+        QMutexLocker lock(&idleLock);
+        if (stopping)
+            return;
+        helping++;
+        helpers.wait(&idleLock, msecs);
+        helping--;
+    }
+
+private:
+    struct Job
+    {
+        QRunnable *runnable;
+        const void *owner;
+
+        Job(QRunnable *runnable = NULL, const void *owner = NULL) : runnable(runnable), owner(owner) {}
+    };
+
+    struct Queue
+    {
+        QMutex lock;
+        QList<Job> work;
+    };
+
+    class Worker : public QThread
+    {
+    public:
+        Worker(StreamScheduler *scheduler, int index) : scheduler(scheduler), index(index) {}
+
+    private:
+        StreamScheduler *scheduler;
+        int index;
+
+        void run()
+        {
+            workerIndex.setLocalData(index + 1);
+            while (true) {
+                if (scheduler->runPending())
+                    continue;
+
+                QMutexLocker lock(&scheduler->idleLock);
+                if (scheduler->stopping)
+                    return;
+                // Work queued since we looked, don't wait for it
+                if (scheduler->pending.load() > 0)
+                    continue;
+                scheduler->sleeping++;
+                scheduler->idle.wait(&scheduler->idleLock);
+                scheduler->sleeping--;
+            }
+        }
+    };
+
+    static int currentWorker()
+    {
+        return workerIndex.hasLocalData() ? workerIndex.localData() - 1 : -1;
+    }
+
+    QRunnable *take(int self, const void *owner)
+    {
+        if (pending.load() == 0)
+            return NULL;
+
+        // Our own newest work first
+        if (self >= 0) {
+            QMutexLocker lock(&queues[self]->lock);
+            QList<Job> &work = queues[self]->work;
+            for (int j=work.size()-1; j>=0; j--)
+                if (!owner || (work[j].owner == owner)) {
+                    pending.deref();
+                    return work.takeAt(j).runnable;
+                }
+        }
+
+        // Otherwise the oldest work of another worker
+        for (int i=1; i<=queues.size(); i++) {
+            Queue *queue = queues[(std::max(self, 0) + i) % queues.size()];
+            QMutexLocker lock(&queue->lock);
+            for (int j=0; j<queue->work.size(); j++)
+                if (!owner || (queue->work[j].owner == owner)) {
+                    pending.deref();
+                    return queue->work.takeAt(j).runnable;
+                }
+        }
+        return NULL;
+    }
+
+    QList<Queue *> queues;
+    QList<Worker *> workers;
+    QAtomicInt pending, dealt;
+
+    QMutex idleLock;
+    QWaitCondition idle, helpers;
+    int sleeping, helping;
+    bool stopping;
+
+    static QThreadStorage<int> workerIndex;
 };
 
+QThreadStorage<int> StreamScheduler::workerIndex;
+
+Q_GLOBAL_STATIC(StreamScheduler, streamScheduler)
+
 class ProcessingStage;
 
 class BasicLoop : public QRunnable, public QFutureInterface<void>
@@ -528,7 +1026,6 @@ protected:
     SharedBuffer *inputBuffer;
     ProcessingStage *nextStage;
     QList<ProcessingStage *> * stages;
-    QThreadPool *threads;
     Transform *transform;
 
 };
@@ -536,7 +1033,7 @@ protected:
 class MultiThreadStage : public ProcessingStage
 {
 public:
-    MultiThreadStage(int _input) : ProcessingStage(_input) {}
+    MultiThreadStage(int _input) : ProcessingStage(_input), batching(1) {}
 
     // Not much to worry about here, we will project the input
     // and try to continue to the next stage.
@@ -546,12 +1043,17 @@ public:
             qFatal("null input to multi-thread stage");
         }
 
-        TemplateList ftes;
-        splitFTEs(input->data, ftes);
-        TemplateList res;
-        transform->project(input->data, res);
-        input->data = res;
-        input->data.append(ftes);
+        if (!input->frames.isEmpty()) {
+            projectBatch(*input);
+        } else {
+            TemplateList ftes;
+            splitFTEs(input->data, ftes);
+            TemplateList res;
+            transform->project(input->data, res);
+            input->data = res;
+            input->data.append(ftes);
+        }
+        input->updateBytes();
 
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
@@ -574,24 +1076,85 @@ public:
     void status() {
         qDebug("multi thread stage %d, nothing to worry about", this->stage_id);
     }
+
+private:
+    // Cleared once the transform is seen to lose track of which frame its outputs came from
+    QAtomicInt batching;
+
+    // The frames of a batch go through the transform in a single call. Each input is tagged with
+    // the index of its frame, and each output is handed back to the frame named by its tag, so
+    // transforms producing any number of templates per input, like detectors, stay correct.
+    // If an output has lost its tag, or the tags come back out of frame order, the frames are
+    // projected one at a time instead, which is safe since the transform isn't time varying.
+    void projectBatch(FrameData &input)
+    {
+        static const QString frameKey("StreamBatchFrame");
+
+        QList<TemplateList> frames = input.split();
+        QList<TemplateList> ftes;
+        TemplateList batch;
+        for (int i=0; i < frames.size(); i++) {
+            ftes.append(TemplateList());
+            splitFTEs(frames[i], ftes.last());
+            foreach (Template t, frames[i]) {
+                t.file.set(frameKey, i);
+                batch.append(t);
+            }
+        }
+
+        TemplateList res;
+        if (batching.load())
+            transform->project(batch, res);
+
+        QList<TemplateList> outputs;
+        bool traced = batching.load() != 0;
+        for (int i=0; traced && (i < frames.size()); i++)
+            outputs.append(TemplateList());
+        for (int i=0, last=0; traced && (i < res.size()); i++) {
+            const int frame = res[i].file.get<int>(frameKey, -1);
+            if ((frame < last) || (frame >= frames.size())) {
+                traced = false;
+                break;
+            }
+            last = frame;
+            outputs[frame].append(res[i]);
+            outputs[frame].last().file.remove(frameKey);
+        }
+
+        if (traced) {
+            frames = outputs;
+        } else {
+            batching.store(0);
+            for (int i=0; i < frames.size(); i++) {
+                TemplateList frame;
+                transform->project(frames[i], frame);
+                frames[i] = frame;
+            }
+        }
+
+        for (int i=0; i < frames.size(); i++)
+            frames[i].append(ftes[i]);
+        input.join(frames);
+    }
 };
 
 class SingleThreadStage : public ProcessingStage
 {
 public:
-    SingleThreadStage(bool input_variance) : ProcessingStage(1)
+    // There are never more than activeFrames frames queued for a stage
+    SingleThreadStage(bool input_variance, int activeFrames) : ProcessingStage(1)
     {
         currentStatus = STOPPING;
         next_target = 0;
         // If the previous stage is single-threaded, queued inputs
-        // are stored in a double buffer
+        // are stored in a single producer single consumer ring
         if (input_variance) {
-            this->inputBuffer = new DoubleBuffer();
+            this->inputBuffer = new DoubleBuffer(activeFrames);
         }
         // If it's multi-threaded we need to put the inputs back in order
         // before we can use them, so we use a sequencing buffer.
         else {
-            this->inputBuffer = new SequencingBuffer();
+            this->inputBuffer = new SequencingBuffer(activeFrames);
         }
     }
 
@@ -628,12 +1191,21 @@ public:
 
         next_target = input->sequenceNumber + 1;
 
-        TemplateList ftes;
-        splitFTEs(input->data, ftes);
-        TemplateList res;
-        transform->projectUpdate(input->data, res);
-        input->data = res;
-        input->data.append(ftes);
+        // Time varying transforms see the frames of a batch one at a time
+        QList<TemplateList> frames = input->split();
+        for (int i=0; i < frames.size(); i++) {
+            TemplateList ftes;
+            splitFTEs(frames[i], ftes);
+            TemplateList res;
+            transform->projectUpdate(frames[i], res);
+            frames[i] = res;
+            frames[i].append(ftes);
+        }
+        if (input->frames.isEmpty())
+            input->data = frames.first();
+        else
+            input->join(frames);
+        input->updateBytes();
 
         should_continue = nextStage->tryAcquireNextStage(input,final);
 
@@ -662,12 +1234,10 @@ public:
         next->start_idx = this->stage_id;
         next->startItem = newItem;
 
-        // We start threads with priority equal to their stage id
-        // This is intended to ensure progression, we do queued late stage
-        // jobs before queued early stage jobs, and so tend to finish frames
-        // rather than go stage by stage. In Qt 5.1, priorities are priorities
-        // so we use the stage_id directly.
-        this->threads->start(next, stage_id);
+        // Work queued by a worker is the next it runs, so the frame we just
+        // finished tends to be continued by later stages before new frames
+        // are started, and stays on this core.
+        streamScheduler()->start(next, stages);
     }
 
 
@@ -713,7 +1283,7 @@ public:
 class EndStage : public SingleThreadStage
 {
 public:
-    EndStage(bool input_variance) : SingleThreadStage(input_variance) {}
+    EndStage(bool input_variance, int activeFrames) : SingleThreadStage(input_variance, activeFrames) {}
 
     ~EndStage() {}
 
@@ -790,7 +1360,7 @@ BR_REGISTER(Transform, CollectOutputTransform)
 class ReadStage : public SingleThreadStage
 {
 public:
-    ReadStage(int activeFrames = 100) : SingleThreadStage(true), dataSource(activeFrames){ }
+    ReadStage(int activeFrames = 100) : SingleThreadStage(true, activeFrames), dataSource(activeFrames){ }
 
     DataSource dataSource;
 
@@ -907,8 +1477,20 @@ class DirectStreamTransform : public CompositeTransform
 
 public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(int activeMemory READ get_activeMemory WRITE set_activeMemory RESET reset_activeMemory)
+    Q_PROPERTY(bool adaptive READ get_adaptive WRITE set_adaptive RESET reset_adaptive)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize)
+    Q_PROPERTY(int maxBatchDelayMs READ get_maxBatchDelayMs WRITE set_maxBatchDelayMs RESET reset_maxBatchDelayMs)
+    Q_PROPERTY(int readBlockBytes READ get_readBlockBytes WRITE set_readBlockBytes RESET reset_readBlockBytes)
+    Q_PROPERTY(int prefetchBlocks READ get_prefetchBlocks WRITE set_prefetchBlocks RESET reset_prefetchBlocks)
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     BR_PROPERTY(int, activeFrames, 100)
+    BR_PROPERTY(int, activeMemory, 1024)
+    BR_PROPERTY(bool, adaptive, true)
+    BR_PROPERTY(int, batchSize, 1)
+    BR_PROPERTY(int, maxBatchDelayMs, 10)
+    BR_PROPERTY(int, readBlockBytes, 4 << 20)
+    BR_PROPERTY(int, prefetchBlocks, 2)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
 
     friend class StreamTransfrom;
@@ -974,6 +1556,10 @@ public:
 
     bool timeVarying() const { return true; }
 
+    // The frames the stream currently admits at once, and a summary of how the budget was chosen
+    int frameBudget() const { return processingStages.isEmpty() ? 0 : readStage->dataSource.budget(); }
+    QString stats() const { return processingStages.isEmpty() ? QString() : readStage->dataSource.stats(); }
+
     void project(const Template &src, Template &dst) const
     {
         TemplateList in;
@@ -1018,6 +1604,10 @@ public:
             return;
         }
 
+        static QAtomicInt warned;
+        if ((Globals->parallelism > 0) && (streamScheduler()->size() != Globals->parallelism) && warned.testAndSetRelaxed(0, 1))
+            qWarning("Streams run on the %d threads of the first Stream, ignoring parallelism %d.", streamScheduler()->size(), Globals->parallelism);
+
         // Start the first thread in the stream.
         QWriteLocker lock(&readStage->statusLock);
         readStage->currentStatus = SingleThreadStage::STARTING;
@@ -1032,8 +1622,20 @@ public:
         lock.unlock();
 
         // Wait for the stream to process the last frame available from
-        // the data source.
-        readStage->dataSource.waitLast();
+        // the data source. Stream project starts work, then waits an indefinite
+        // time for it to finish. If this is a nested stream running on one of the
+        // scheduler's workers, this kind of hold and wait could leave every worker
+        // waiting on work that no worker is free to run, so instead the worker keeps
+        // running queued work, much as a thread waiting on a QFutureSynchronizer
+        // steals the jobs it waits on. Only this stream's work is taken, so the wait
+        // never grows to include unrelated streams, or the streams they wait on.
+        if (streamScheduler()->isWorker()) {
+            while (!readStage->dataSource.isLastReturned())
+                if (!streamScheduler()->runPending(&processingStages))
+                    streamScheduler()->helpWait(1);
+        } else {
+            readStage->dataSource.waitLast();
+        }
 
         // Now that there are no more incoming frames, call finalize
         // on each transform in turn to collect any last templates
@@ -1065,6 +1667,9 @@ public:
         endPoint->finalize(output);
         dst.append(output);
 
+        if (Globals->verbose)
+            qDebug("%s", qPrintable(readStage->dataSource.stats()));
+
         foreach (ProcessingStage *stage, processingStages)
             stage->reset();
     }
@@ -1083,19 +1688,6 @@ public:
         // correctly.
         CompositeTransform::init();
 
-        // We share a thread pool across streams attached to the same
-        // parent tranform, retrieve or create a thread pool based
-        // on our parent transform.
-        QMutexLocker poolLock(&poolsAccess);
-        QHash<QObject *, QThreadPool *>::Iterator it;
-        if (!pools.contains(this->parent())) {
-            it = pools.insert(this->parent(), new QThreadPool());
-            it.value()->setMaxThreadCount(Globals->parallelism);
-        }
-        else it = pools.find(this->parent());
-        threads = it.value();
-        poolLock.unlock();
-
         // Are our children time varying or not? This decides whether
         // we run them in single threaded or multi threaded stages
         stage_variance.clear();
@@ -1111,7 +1703,6 @@ public:
         processingStages.push_back(readStage);
         readStage->stage_id = 0;
         readStage->stages = &this->processingStages;
-        readStage->threads = this->threads;
 
         // Initialize and link a processing stage for each of our child
         // transforms.
@@ -1122,7 +1713,7 @@ public:
             if (stage_variance[i])
                 // Whether or not the previous stage is multi-threaded controls
                 // the type of input buffer we need in a single threaded stage.
-                processingStages.append(new SingleThreadStage(prev_stage_variance));
+                processingStages.append(new SingleThreadStage(prev_stage_variance, activeFrames));
             else
                 processingStages.append(new MultiThreadStage(Globals->parallelism));
 
@@ -1133,7 +1724,6 @@ public:
             processingStages[i]->nextStage = processingStages[i+1];
 
             processingStages.last()->stages = &this->processingStages;
-            processingStages.last()->threads = this->threads;
 
             processingStages.last()->transform = transforms[i];
             prev_stage_variance = stage_variance[i];
@@ -1141,14 +1731,13 @@ public:
 
         // We also have the last stage, which just puts the output of the
         // previous stages on a template list.
-        collectionStage = new EndStage(prev_stage_variance);
+        collectionStage = new EndStage(prev_stage_variance, activeFrames);
         collectionStage->transform = this->endPoint;
 
 
         processingStages.append(collectionStage);
         collectionStage->stage_id = next_stage_id;
         collectionStage->stages = &this->processingStages;
-        collectionStage->threads = this->threads;
 
         // the last transform stage points to collection stage
         processingStages[processingStages.size() - 2]->nextStage = collectionStage;
@@ -1156,6 +1745,22 @@ public:
         // And the collection stage points to the read stage, because this is
         // a ring buffer.
         collectionStage->nextStage = readStage;
+
+        // activeFrames bounds the frames in flight, within it the data source admits
+        // as many as keep throughput rising and fit in activeMemory megabytes.
+        readStage->dataSource.configure(qint64(activeMemory) << 20, adaptive);
+
+        // Multi-threaded stages project each batch of batchSize frames with one call,
+        // single threaded stages still see one frame at a time.
+        readStage->dataSource.batchSize = std::max(1, batchSize);
+        readStage->dataSource.maxBatchDelay = maxBatchDelayMs;
+
+        // Input galleries are decoded on their own thread, prefetchBlocks blocks ahead of the
+        // one being streamed, so with the default of 2 they are triple buffered.
+        readStage->dataSource.configureReads(readBlockBytes, prefetchBlocks);
+        for (int i=1; i < processingStages.size(); i++)
+            if (stage_variance.value(i-1, true))
+                readStage->dataSource.queues.append(processingStages[i]->inputBuffer);
     }
 
     ~DirectStreamTransform()
@@ -1176,25 +1781,6 @@ protected:
 
     QList<ProcessingStage *> processingStages;
 
-    // This is a map from parent transforms (of Streams) to thread pools. Rather
-    // than starting threads on the global thread pool, Stream uses separate thread pools
-    // keyed on their parent transform. This is necessary because stream's project starts
-    // threads, then enters an indefinite wait for them to finish. Since we are starting
-    // threads using thread pools, threads themselves are a limited resource. Therefore,
-    // the type of hold and wait done by stream project can lead to deadlock unless
-    // resources are ordered in such a way that a circular wait will not occur. The points
-    // of this hash is to introduce a resource ordering (on threads) that mirrors the structure
-    // of the algorithm. So, as long as the structure of the algorithm is a DAG, the wait done
-    // by stream project will not be circular, since every thread in stream project is waiting
-    // for threads at a lower level to do the work.
-    // This issue doesn't come up in distribute, since a thread waiting on a QFutureSynchronizer
-    // will steal work from those jobs, so in that sense distribute isn't doing a hold and wait.
-    // Waiting for a QFutureSynchronzier isn't really possible here since stream runs an indeteriminate
-    // number of jobs.
-    static QHash<QObject *, QThreadPool *> pools;
-    static QMutex poolsAccess;
-    QThreadPool *threads;
-
     void _project(const Template &src, Template &dst) const
     {
         (void) src; (void) dst;
@@ -1207,9 +1793,6 @@ protected:
     }
 };
 
-QHash<QObject *, QThreadPool *> DirectStreamTransform::pools;
-QMutex DirectStreamTransform::poolsAccess;
-
 BR_REGISTER(Transform, DirectStreamTransform)
 
 class StreamTransform : public WrapperTransform
@@ -1223,12 +1806,27 @@ public:
 
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(int activeMemory READ get_activeMemory WRITE set_activeMemory RESET reset_activeMemory)
+    Q_PROPERTY(bool adaptive READ get_adaptive WRITE set_adaptive RESET reset_adaptive)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize)
+    Q_PROPERTY(int maxBatchDelayMs READ get_maxBatchDelayMs WRITE set_maxBatchDelayMs RESET reset_maxBatchDelayMs)
+    Q_PROPERTY(int readBlockBytes READ get_readBlockBytes WRITE set_readBlockBytes RESET reset_readBlockBytes)
+    Q_PROPERTY(int prefetchBlocks READ get_prefetchBlocks WRITE set_prefetchBlocks RESET reset_prefetchBlocks)
 
     BR_PROPERTY(int, activeFrames, 100)
+    BR_PROPERTY(int, activeMemory, 1024)
+    BR_PROPERTY(bool, adaptive, true)
+    BR_PROPERTY(int, batchSize, 1)
+    BR_PROPERTY(int, maxBatchDelayMs, 10)
+    BR_PROPERTY(int, readBlockBytes, 4 << 20)
+    BR_PROPERTY(int, prefetchBlocks, 2)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
 
     bool timeVarying() const { return true; }
 
+    int frameBudget() const { return basis ? basis->frameBudget() : 0; }
+    QString stats() const { return basis ? basis->stats() : QString(); }
+
     void project(const Template &src, Template &dst) const
     {
         basis->project(src,dst);
@@ -1266,6 +1864,12 @@ public:
         basis = QSharedPointer<DirectStreamTransform>((DirectStreamTransform *) Transform::make("DirectStream",this));
         basis->transforms.clear();
         basis->activeFrames = this->activeFrames;
+        basis->activeMemory = this->activeMemory;
+        basis->adaptive = this->adaptive;
+        basis->batchSize = this->batchSize;
+        basis->maxBatchDelayMs = this->maxBatchDelayMs;
+        basis->readBlockBytes = this->readBlockBytes;
+        basis->prefetchBlocks = this->prefetchBlocks;
         basis->endPoint = this->endPoint;
 
         // We need at least a CompositeTransform * to acess transform's children.
@@ -1339,6 +1943,12 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis->smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->activeMemory = this->activeMemory;
+        res->adaptive = this->adaptive;
+        res->batchSize = this->batchSize;
+        res->maxBatchDelayMs = this->maxBatchDelayMs;
+        res->readBlockBytes = this->readBlockBytes;
+        res->prefetchBlocks = this->prefetchBlocks;
         return res;
     }
 
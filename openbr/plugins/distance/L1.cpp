@@ -30,6 +30,8 @@ class L1Distance : public UntrainableDistance
 {
     Q_OBJECT
 
+    bool symmetric() const { return true; }
+
     float compare(const cv::Mat &a, const cv::Mat &b) const
     {
         const int size = a.rows * a.cols;
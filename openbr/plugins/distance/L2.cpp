@@ -17,6 +17,8 @@
 #include <Eigen/Dense>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+#include <openbr/core/opencvutils.h>
 
 namespace br
 {
@@ -24,19 +26,53 @@ namespace br
 /*!
  * \ingroup distances
  * \brief L2 distance computed using eigen.
+ *
+ * If \em half is set, \c CV_16U matrices hold IEEE half precision values, as written by CvtHalf.
  * \author Josh Klontz \cite jklontz
  */
 class L2Distance : public UntrainableDistance
 {
     Q_OBJECT
+    Q_PROPERTY(bool half READ get_half WRITE set_half RESET reset_half STORED false)
+    BR_PROPERTY(bool, half, false)
+
+    bool symmetric() const { return true; }
 
     float compare(const cv::Mat &a, const cv::Mat &b) const
     {
+        if ((a.type() != b.type()) || (a.total() != b.total()))
+            return -std::numeric_limits<float>::max();
+
+        if (half && (a.type() == CV_16UC1) && a.isContinuous() && b.isContinuous())
+            return l2_half(a.ptr<ushort>(), b.ptr<ushort>(), int(a.total()));
+
+        if ((a.type() != CV_32FC1) || !a.isContinuous() || !b.isContinuous()) {
+            cv::Mat singleA, singleB;
+            OpenCVUtils::cvtFloat(a, singleA, half);
+            OpenCVUtils::cvtFloat(b, singleB, half);
+            return compare(singleA.reshape(1, 1).clone(), singleB.reshape(1, 1).clone());
+        }
+
         const int size = a.rows * a.cols;
         Eigen::Map<Eigen::VectorXf> aMap((float*)a.data, size);
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.data, size);
         return (aMap-bMap).squaredNorm();
     }
+
+    bool compareProducts(const cv::Mat &products, const cv::Mat &targetNorms, const cv::Mat &queryNorms, cv::Mat &scores) const
+    {
+        if (scores.data != products.data)
+            products.copyTo(scores);
+
+        const float *targetNorm = targetNorms.ptr<float>();
+        const float *queryNorm = queryNorms.ptr<float>();
+        for (int i=0; i<scores.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<scores.cols; j++)
+                score[j] = std::max(0.f, queryNorm[i] + targetNorm[j] - 2*score[j]);
+        }
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, L2Distance)
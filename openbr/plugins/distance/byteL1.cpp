@@ -33,6 +33,41 @@ class ByteL1Distance : public UntrainableDistance
     {
         return l1(a, b, size);
     }
+
+    bool batches() const { return true; }
+    bool symmetric() const { return true; }
+
+    bool compareBatch(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores, float lower, float upper) const
+    {
+        (void) lower;
+        if ((targets.type() != CV_8UC1) || (queries.type() != CV_8UC1) || (targets.cols != queries.cols))
+            return false;
+
+        const bool bounded = upper < std::numeric_limits<float>::max();
+        scores.create(queries.rows, targets.rows, CV_32FC1);
+        for (int i=0; i<queries.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<targets.rows; j++)
+                score[j] = bounded ? l1_bounded(targets.ptr(j), queries.ptr(i), targets.cols, upper)
+                                   : l1(targets.ptr(j), queries.ptr(i), targets.cols);
+        }
+        return true;
+    }
+
+    // Larger distances are worse, so only the upper bound allows stopping early
+    float compareBounded(const Template &a, const Template &b, float lower, float upper) const
+    {
+        (void) lower;
+        if ((a.size() != 1) || (b.size() != 1))
+            return Distance::compare(a, b);
+
+        const cv::Mat &ma = a.first(), &mb = b.first();
+        if (ma.empty() || mb.empty() || (ma.rows != mb.rows) || (ma.cols != mb.cols) || (ma.elemSize() != mb.elemSize()) ||
+            !ma.isContinuous() || !mb.isContinuous())
+            return Distance::compare(a, b);
+
+        return l1_bounded(ma.data, mb.data, ma.total() * ma.elemSize(), upper);
+    }
 };
 
 BR_REGISTER(Distance, ByteL1Distance)
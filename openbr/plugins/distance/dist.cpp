@@ -16,6 +16,8 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -25,6 +27,8 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Standard distance metrics
+ *
+ * If \em half is set, \c CV_16U matrices hold IEEE half precision values, as written by CvtHalf.
  * \author Josh Klontz \cite jklontz
  */
 class DistDistance : public UntrainableDistance
@@ -33,6 +37,7 @@ class DistDistance : public UntrainableDistance
     Q_ENUMS(Metric)
     Q_PROPERTY(Metric metric READ get_metric WRITE set_metric RESET reset_metric STORED false)
     Q_PROPERTY(bool negLogPlusOne READ get_negLogPlusOne WRITE set_negLogPlusOne RESET reset_negLogPlusOne STORED false)
+    Q_PROPERTY(bool half READ get_half WRITE set_half RESET reset_half STORED false)
 
 public:
     /*!< */
@@ -49,6 +54,7 @@ public:
 private:
     BR_PROPERTY(Metric, metric, L2)
     BR_PROPERTY(bool, negLogPlusOne, true)
+    BR_PROPERTY(bool, half, false)
 
     float compare(const Mat &a, const Mat &b) const
     {
@@ -56,6 +62,9 @@ private:
             (a.type() != b.type()))
                 return -std::numeric_limits<float>::max();
 
+        if (half && (a.depth() == CV_16U))
+            return compareHalf(a, b);
+
 // TODO: this max value is never returned based on the switch / default
         float result = std::numeric_limits<float>::max();
         switch (metric) {
@@ -93,6 +102,149 @@ private:
         return negLogPlusOne ? -log(result+1) : result;
     }
 
+    // Half precision vectors are widened on the fly by the kernels instead of being converted
+    float compareHalf(const Mat &a, const Mat &b) const
+    {
+        if (((metric != L1) && (metric != L2) && (metric != Cosine) && (metric != Dot)) || !a.isContinuous() || !b.isContinuous()) {
+            Mat singleA, singleB;
+            OpenCVUtils::cvtFloat(a, singleA, true);
+            OpenCVUtils::cvtFloat(b, singleB, true);
+            return compare(singleA, singleB);
+        }
+
+        const ushort *pa = a.ptr<ushort>(), *pb = b.ptr<ushort>();
+        const int size = int(a.total() * a.channels());
+        float result;
+        switch (metric) {
+          case Cosine:
+            return dot_half(pa, pb, size) / (sqrt(dot_half(pa, pa, size))*sqrt(dot_half(pb, pb, size)));
+          case Dot:
+            return dot_half(pa, pb, size);
+          case L1:
+            result = l1_half(pa, pb, size);
+            break;
+          default:
+            result = sqrt(l2_half(pa, pb, size));
+        }
+
+        if (result != result)
+            qFatal("NaN result.");
+
+        return negLogPlusOne ? -log(result+1) : result;
+    }
+
+    // OpenCV's chi-squared distance divides by the first histogram
+    bool symmetric() const
+    {
+        return metric != ChiSquared;
+    }
+
+    bool batches() const
+    {
+        return (metric == L2) || (metric == Cosine) || (metric == Dot);
+    }
+
+    bool compareBatch(const Mat &targets, const Mat &queries, Mat &scores, float, float) const
+    {
+        if ((metric != L2) && (metric != Cosine) && (metric != Dot))
+            return false;
+
+        if (half && (targets.type() == CV_16UC1) && (queries.type() == CV_16UC1) && (targets.cols == queries.cols)) {
+            const int size = targets.cols;
+            Mat targetNorms(targets.rows, 1, CV_32FC1), queryNorms(queries.rows, 1, CV_32FC1);
+            for (int i=0; i<targets.rows; i++)
+                targetNorms.at<float>(i) = dot_half(targets.ptr<ushort>(i), targets.ptr<ushort>(i), size);
+            for (int i=0; i<queries.rows; i++)
+                queryNorms.at<float>(i) = dot_half(queries.ptr<ushort>(i), queries.ptr<ushort>(i), size);
+
+            scores.create(queries.rows, targets.rows, CV_32FC1);
+            for (int i=0; i<queries.rows; i++) {
+                float *score = scores.ptr<float>(i);
+                for (int j=0; j<targets.rows; j++)
+                    score[j] = dot_half(queries.ptr<ushort>(i), targets.ptr<ushort>(j), size);
+            }
+            return compareProducts(scores, targetNorms, queryNorms, scores);
+        }
+        if ((targets.type() != CV_32FC1) || (queries.type() != CV_32FC1) || (targets.cols != queries.cols))
+            return false;
+
+        // The whole tile of dot products as a single matrix multiply
+        gemm(queries, targets, 1, Mat(), 0, scores, GEMM_2_T);
+        if (metric == Dot)
+            return true;
+
+        // L2 and Cosine follow from the dot products and the squared norms of each row
+        Mat targetNorms, queryNorms;
+        reduce(targets.mul(targets), targetNorms, 1, CV_REDUCE_SUM);
+        reduce(queries.mul(queries), queryNorms, 1, CV_REDUCE_SUM);
+        return compareProducts(scores, targetNorms, queryNorms, scores);
+    }
+
+    bool compareProducts(const Mat &products, const Mat &targetNorms, const Mat &queryNorms, Mat &scores) const
+    {
+        if ((metric != L2) && (metric != Cosine) && (metric != Dot))
+            return false;
+
+        if (scores.data != products.data)
+            products.copyTo(scores);
+        if (metric == Dot)
+            return true;
+
+        const float *targetNorm = targetNorms.ptr<float>();
+        const float *queryNorm = queryNorms.ptr<float>();
+        for (int i=0; i<scores.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<scores.cols; j++) {
+                if (metric == Cosine) {
+                    score[j] = score[j] / (sqrt(queryNorm[i])*sqrt(targetNorm[j]));
+                } else {
+                    const float result = sqrt(std::max(0.f, queryNorm[i] + targetNorm[j] - 2*score[j]));
+                    if (result != result)
+                        qFatal("NaN result.");
+                    score[j] = negLogPlusOne ? -log(result+1) : result;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // L1 and L2 partial sums only grow, so accumulation can stop once they pass the largest distance of interest
+    float compareBounded(const Template &a, const Template &b, float lower, float upper) const
+    {
+        if (((metric != L1) && (metric != L2)) || (a.size() != 1) || (b.size() != 1))
+            return Distance::compare(a, b);
+
+        const Mat &ma = a.first(), &mb = b.first();
+        if ((ma.size != mb.size) || (ma.type() != CV_32FC1) || (mb.type() != CV_32FC1) || !ma.isContinuous() || !mb.isContinuous())
+            return Distance::compare(a, b);
+
+        // Scores are either the distance or its decreasing -log(distance+1) transform
+        double limit = std::numeric_limits<double>::max();
+        if (negLogPlusOne) { if (lower > -std::numeric_limits<float>::max()) limit = exp(-double(lower)) - 1; }
+        else if (upper < std::numeric_limits<float>::max()) limit = upper;
+        if (metric == L2)
+            limit = (limit < sqrt(std::numeric_limits<double>::max())) ? limit*limit : std::numeric_limits<double>::max();
+
+        static const int chunk = 64;
+        const float *pa = ma.ptr<float>(), *pb = mb.ptr<float>();
+        const int size = int(ma.total());
+        double sum = 0;
+        for (int i=0; (i<size) && (sum <= limit); i+=chunk) {
+            const int end = std::min(i+chunk, size);
+            for (int j=i; j<end; j++) {
+                const double difference = pa[j] - pb[j];
+                sum += (metric == L1) ? fabs(difference) : difference*difference;
+            }
+        }
+
+        const float result = (metric == L2) ? sqrt(sum) : sum;
+        if (result != result)
+            qFatal("NaN result.");
+
+        return negLogPlusOne ? -log(result+1) : result;
+    }
+
     static float cosine(const Mat &a, const Mat &b)
     {
         float dot = 0;
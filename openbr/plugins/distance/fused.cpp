@@ -0,0 +1,204 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+void ScoreMap::invert(float &lower, float &upper) const
+{
+    const float max = std::numeric_limits<float>::max();
+    const bool hasLower = lower > -max, hasUpper = upper < max;
+    double innerLower = -max, innerUpper = max;
+
+    switch (kind) {
+      case Affine:
+        // A negative scale swaps the bounds
+        if (a > 0) {
+            if (hasLower) innerLower = lower/a + b;
+            if (hasUpper) innerUpper = upper/a + b;
+        } else if (a < 0) {
+            if (hasUpper) innerLower = upper/a + b;
+            if (hasLower) innerUpper = lower/a + b;
+        }
+        break;
+      case NegativeLogPlusOne:
+        // Decreasing, so the bounds swap
+        if (hasUpper) innerLower = exp(-double(upper)) - 1;
+        if (hasLower) innerUpper = exp(-double(lower)) - 1;
+        break;
+      default:
+        if (hasLower) innerLower = lower*b + a;
+        if (hasUpper) innerUpper = upper*b + a;
+    }
+
+    lower = float(std::max(double(-max), std::min(double(max), innerLower)));
+    upper = float(std::max(double(-max), std::min(double(max), innerUpper)));
+}
+
+/*!
+ * \ingroup distances
+ * \brief A distance followed by a chain of br::ScoreMap, the result of simplifying nested br::ScoreMapDistance.
+ *
+ * Tiles scored by the innermost distance are normalized in a single pass.
+ */
+class FusedDistance : public UntrainableDistance
+{
+    Q_OBJECT
+
+    Distance *distance;
+    QVector<ScoreMap> maps; // Innermost first
+
+public:
+    FusedDistance(Distance *distance, const QVector<ScoreMap> &maps)
+        : distance(distance), maps(maps) {}
+
+    void prepareTargets(const TemplateList &targets)
+    {
+        distance->prepareTargets(targets);
+    }
+
+private:
+    inline float apply(float score) const
+    {
+        for (int i=0; i<maps.size(); i++)
+            score = maps[i](score);
+        return score;
+    }
+
+    void invert(float &lower, float &upper) const
+    {
+        for (int i=maps.size()-1; i>=0; i--)
+            maps[i].invert(lower, upper);
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return apply(distance->compare(a, b));
+    }
+
+    float compareBounded(const Template &a, const Template &b, float lower, float upper) const
+    {
+        invert(lower, upper);
+        return apply(distance->compareBounded(a, b, lower, upper));
+    }
+
+    bool batches() const
+    {
+        return distance->batches();
+    }
+
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
+
+    bool compareBatch(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores, float lower, float upper) const
+    {
+        invert(lower, upper);
+        if (!distance->compareBatch(targets, queries, scores, lower, upper))
+            return false;
+
+        for (int i=0; i<scores.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<scores.cols; j++)
+                score[j] = apply(score[j]);
+        }
+        return true;
+    }
+
+    bool compareProducts(const cv::Mat &products, const cv::Mat &targetNorms, const cv::Mat &queryNorms, cv::Mat &scores) const
+    {
+        if (!distance->compareProducts(products, targetNorms, queryNorms, scores))
+            return false;
+
+        for (int i=0; i<scores.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<scores.cols; j++)
+                score[j] = apply(score[j]);
+        }
+        return true;
+    }
+};
+
+Distance *ScoreMapDistance::simplify(bool &newDistance)
+{
+    QVector<ScoreMap> maps;
+    Distance *inner = this;
+    while (ScoreMapDistance *wrapper = qobject_cast<ScoreMapDistance*>(inner)) {
+        maps.prepend(wrapper->scoreMap());
+        inner = wrapper->wrapped();
+    }
+
+    newDistance = false;
+    if (inner == NULL)
+        return this;
+
+    bool newInner;
+    Distance *simplified = inner->simplify(newInner);
+    FusedDistance *fused = new FusedDistance(simplified, maps);
+    if (newInner)
+        simplified->setParent(fused);
+    newDistance = true;
+    return fused;
+}
+
+float ScoreMapDistance::compare(const Template &a, const Template &b) const
+{
+    return scoreMap()(wrapped()->compare(a, b));
+}
+
+float ScoreMapDistance::compareBounded(const Template &a, const Template &b, float lower, float upper) const
+{
+    const ScoreMap map = scoreMap();
+    map.invert(lower, upper);
+    return map(wrapped()->compareBounded(a, b, lower, upper));
+}
+
+bool ScoreMapDistance::compareBatch(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores, float lower, float upper) const
+{
+    const ScoreMap map = scoreMap();
+    map.invert(lower, upper);
+    if (!wrapped()->compareBatch(targets, queries, scores, lower, upper))
+        return false;
+
+    for (int i=0; i<scores.rows; i++) {
+        float *score = scores.ptr<float>(i);
+        for (int j=0; j<scores.cols; j++)
+            score[j] = map(score[j]);
+    }
+    return true;
+}
+
+bool ScoreMapDistance::compareProducts(const cv::Mat &products, const cv::Mat &targetNorms, const cv::Mat &queryNorms, cv::Mat &scores) const
+{
+    if (!wrapped()->compareProducts(products, targetNorms, queryNorms, scores))
+        return false;
+
+    const ScoreMap map = scoreMap();
+    for (int i=0; i<scores.rows; i++) {
+        float *score = scores.ptr<float>(i);
+        for (int j=0; j<scores.cols; j++)
+            score[j] = map(score[j]);
+    }
+    return true;
+}
+
+} // namespace br
+
+#include "distance/fused.moc"
@@ -35,6 +35,34 @@ class HalfByteL1Distance : public UntrainableDistance
     {
         return packed_l1(a.data, b.data, a.total());
     }
+
+    bool batches() const { return true; }
+    bool symmetric() const { return true; }
+
+    bool compareBatch(const Mat &targets, const Mat &queries, Mat &scores, float lower, float upper) const
+    {
+        (void) lower;
+        if ((targets.type() != CV_8UC1) || (queries.type() != CV_8UC1) || (targets.cols != queries.cols))
+            return false;
+
+        const bool bounded = upper < std::numeric_limits<float>::max();
+        scores.create(queries.rows, targets.rows, CV_32FC1);
+        for (int i=0; i<queries.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<targets.rows; j++)
+                score[j] = bounded ? packed_l1_bounded(targets.ptr(j), queries.ptr(i), targets.cols, upper)
+                                   : packed_l1(targets.ptr(j), queries.ptr(i), targets.cols);
+        }
+        return true;
+    }
+
+    float compareBounded(const Template &a, const Template &b, float lower, float upper) const
+    {
+        (void) lower;
+        if ((a.size() != 1) || (b.size() != 1) || !a.first().isContinuous() || !b.first().isContinuous())
+            return Distance::compare(a, b);
+        return packed_l1_bounded(a.first().data, b.first().data, a.first().total(), upper);
+    }
 };
 
 BR_REGISTER(Distance, HalfByteL1Distance)
@@ -0,0 +1,58 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Number of differing bits between binary codes, such as those produced by Binarize or ITQ.
+ */
+class HammingDistance : public UntrainableDistance
+{
+    Q_OBJECT
+
+    float compare(const unsigned char *a, const unsigned char *b, size_t size) const
+    {
+        return hamming(a, b, size);
+    }
+
+    bool batches() const { return true; }
+    bool symmetric() const { return true; }
+
+    bool compareBatch(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores, float, float) const
+    {
+        if ((targets.type() != CV_8UC1) || (queries.type() != CV_8UC1) || (targets.cols != queries.cols))
+            return false;
+
+        scores.create(queries.rows, targets.rows, CV_32FC1);
+        for (int i=0; i<queries.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<targets.rows; j++)
+                score[j] = hamming(targets.ptr(j), queries.ptr(i), targets.cols);
+        }
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, HammingDistance)
+
+} // namespace br
+
+#include "distance/hamming.moc"
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <opencv2/features2d/features2d.hpp>
+#include <opencv2/flann/flann.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
 
@@ -26,6 +27,11 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV Key Point Matcher
+ *
+ * If \em indexTargets is set, prepareTargets() builds a FLANN index over the descriptors of each target,
+ * a randomized k-d tree for \c CV_32F descriptors or LSH for binary \c CV_8U descriptors.
+ * Comparisons against an indexed target then match each query descriptor with an approximate search
+ * of the index, using \em checks leaves, instead of running \em matcher from scratch.
  * \author Josh Klontz \cite jklontz
  */
 class KeyPointMatcherDistance : public UntrainableDistance
@@ -33,11 +39,27 @@ class KeyPointMatcherDistance : public UntrainableDistance
     Q_OBJECT
     Q_PROPERTY(QString matcher READ get_matcher WRITE set_matcher RESET reset_matcher STORED false)
     Q_PROPERTY(float maxRatio READ get_maxRatio WRITE set_maxRatio RESET reset_maxRatio STORED false)
+    Q_PROPERTY(bool indexTargets READ get_indexTargets WRITE set_indexTargets RESET reset_indexTargets STORED false)
+    Q_PROPERTY(int checks READ get_checks WRITE set_checks RESET reset_checks STORED false)
     BR_PROPERTY(QString, matcher, "BruteForce")
     BR_PROPERTY(float, maxRatio, 0.8)
+    BR_PROPERTY(bool, indexTargets, false)
+    BR_PROPERTY(int, checks, 32)
 
     Ptr<DescriptorMatcher> descriptorMatcher;
 
+    struct TargetIndex
+    {
+        Mat target; // Holds a reference so the key's data can't be freed and reused while indexed
+        Mat descriptors; // Keeps the indexed data alive
+        QSharedPointer<flann::Index> index;
+        QSharedPointer<QMutex> lock; // FLANN searches aren't safe to run concurrently on one index
+        bool hamming;
+    };
+
+    // Indexes of the prepared targets, keyed by the data of their descriptor matrix
+    QHash<const uchar*, TargetIndex> targetIndexes;
+
     void init()
     {
         descriptorMatcher = DescriptorMatcher::create(matcher.toStdString());
@@ -45,18 +67,80 @@ class KeyPointMatcherDistance : public UntrainableDistance
             qFatal("Failed to create DescriptorMatcher: %s", qPrintable(matcher));
     }
 
+    void prepareTargets(const TemplateList &targets)
+    {
+        targetIndexes.clear();
+        if (!indexTargets)
+            return;
+
+        foreach (const Template &target, targets)
+            foreach (const Mat &m, target) {
+                if ((m.rows < 2) || targetIndexes.contains(m.data))
+                    continue;
+
+                TargetIndex targetIndex;
+                targetIndex.target = m;
+                targetIndex.descriptors = m.isContinuous() ? m : m.clone();
+                targetIndex.lock = QSharedPointer<QMutex>(new QMutex());
+                if (m.type() == CV_32FC1) {
+                    targetIndex.index = QSharedPointer<flann::Index>(new flann::Index(targetIndex.descriptors, flann::KDTreeIndexParams(4)));
+                    targetIndex.hamming = false;
+                } else if (m.type() == CV_8UC1) {
+                    targetIndex.index = QSharedPointer<flann::Index>(new flann::Index(targetIndex.descriptors, flann::LshIndexParams(12, 20, 2), cvflann::FLANN_DIST_HAMMING));
+                    targetIndex.hamming = true;
+                } else {
+                    continue;
+                }
+                targetIndexes.insert(m.data, targetIndex);
+            }
+    }
+
+    // Ratio test distances of the query descriptors searched in the target's index, false if the target isn't indexed
+    bool searchIndex(const Mat &target, const Mat &query, QList<float> &distances) const
+    {
+        QHash<const uchar*, TargetIndex>::const_iterator it = targetIndexes.find(target.data);
+        if ((it == targetIndexes.end()) || (it->target.size() != target.size()) || (it->target.step != target.step) || (it->descriptors.type() != query.type()))
+            return false;
+
+        const Mat queries = query.isContinuous() ? query : query.clone();
+        Mat indices, dists;
+        {
+            QMutexLocker locker(it->lock.data());
+            it->index->knnSearch(queries, indices, dists, 2, flann::SearchParams(checks));
+        }
+        if (dists.type() != CV_32F)
+            dists.convertTo(dists, CV_32F);
+
+        for (int i=0; i<indices.rows; i++) {
+            if ((indices.at<int>(i, 0) < 0) || (indices.at<int>(i, 1) < 0)) continue;
+
+            // The k-d tree reports squared L2 distances
+            float first = dists.at<float>(i, 0), second = dists.at<float>(i, 1);
+            if (!it->hamming) {
+                first = sqrt(first);
+                second = sqrt(second);
+            }
+
+            if (first / second > maxRatio) continue;
+            distances.append(first);
+        }
+        return true;
+    }
+
     float compare(const Mat &a, const Mat &b) const
     {
         if ((a.rows < 2) || (b.rows < 2)) return 0;
 
-        std::vector< std::vector<DMatch> > matches;
-        if (a.rows < b.rows) descriptorMatcher->knnMatch(a, b, matches, 2);
-        else                 descriptorMatcher->knnMatch(b, a, matches, 2);
-
         QList<float> distances;
-        foreach (const std::vector<DMatch> &match, matches) {
-            if (match[0].distance / match[1].distance > maxRatio) continue;
-            distances.append(match[0].distance);
+        if (targetIndexes.isEmpty() || (!searchIndex(a, b, distances) && !searchIndex(b, a, distances))) {
+            std::vector< std::vector<DMatch> > matches;
+            if (a.rows < b.rows) descriptorMatcher->knnMatch(a, b, matches, 2);
+            else                 descriptorMatcher->knnMatch(b, a, matches, 2);
+
+            foreach (const std::vector<DMatch> &match, matches) {
+                if (match[0].distance / match[1].distance > maxRatio) continue;
+                distances.append(match[0].distance);
+            }
         }
         qSort(distances);
 
@@ -24,20 +24,30 @@ namespace br
  * \brief Returns -log(distance(a,b)+1)
  * \author Josh Klontz \cite jklontz
  */
-class NegativeLogPlusOneDistance : public UntrainableDistance
+class NegativeLogPlusOneDistance : public ScoreMapDistance
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     BR_PROPERTY(br::Distance*, distance, NULL)
 
+    bool trainable()
+    {
+        return false;
+    }
+
     void train(const TemplateList &src)
     {
         distance->train(src);
     }
 
-    float compare(const Template &a, const Template &b) const
+    ScoreMap scoreMap() const
+    {
+        return ScoreMap(ScoreMap::NegativeLogPlusOne);
+    }
+
+    Distance *wrapped() const
     {
-        return -log(distance->compare(a,b)+1);
+        return distance;
     }
 
     void store(QDataStream &stream) const
@@ -0,0 +1,156 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Set-to-set comparison of templates holding many matrices, such as the frames of a video.
+ *
+ * The matrices of each template are packed into one block and the whole table of pairwise scores
+ * is computed with a single br::Distance::compareBatch call, falling back to comparing pairs individually
+ * when the distance does not support it. As in br::Distance::compare, pairs scoring
+ * -FLT_MAX are ignored and -FLT_MAX is returned if no pairs remain. The remaining scores are reduced by:
+ * \li \c Mean - their average
+ * \li \c Max - the best pair
+ * \li \c Min - the worst pair
+ * \li \c TopKMean - the average of the \em k best pairs, or all of them if \em k is less than one
+ * \li \c Softmax - their average weighted by exp(score/\em temperature)
+ */
+class SetDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Reduction)
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(Reduction reduction READ get_reduction WRITE set_reduction RESET reset_reduction STORED false)
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    Q_PROPERTY(float temperature READ get_temperature WRITE set_temperature RESET reset_temperature STORED false)
+
+public:
+    /*!< */
+    enum Reduction { Mean,
+                     Max,
+                     Min,
+                     TopKMean,
+                     Softmax };
+
+private:
+    BR_PROPERTY(br::Distance*, distance, make("Dist(L2)"))
+    BR_PROPERTY(Reduction, reduction, Mean)
+    BR_PROPERTY(int, k, 1)
+    BR_PROPERTY(float, temperature, 1)
+
+    bool trainable()
+    {
+        return distance->trainable();
+    }
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+    }
+
+    void init()
+    {
+        if ((reduction == Softmax) && !(temperature > 0))
+            qFatal("Softmax temperature must be positive.");
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        // The full table of pair scores, one row per matrix of b
+        Mat packedA, packedB, table;
+        if (!distance->batches() || !a.pack(packedA) || !b.pack(packedB) || !distance->compareBatch(packedA, packedB, table)) {
+            // Pairs are compared as templates, some distances only implement that level
+            table.create(b.size(), a.size(), CV_32FC1);
+            for (int i=0; i<b.size(); i++)
+                for (int j=0; j<a.size(); j++)
+                    table.at<float>(i, j) = distance->compare(Template(a.file, a[j]), Template(b.file, b[i]));
+        }
+
+        QVector<float> scores; scores.reserve(int(table.total()));
+        for (int i=0; i<table.rows; i++) {
+            const float *score = table.ptr<float>(i);
+            for (int j=0; j<table.cols; j++)
+                if (score[j] != -std::numeric_limits<float>::max())
+                    scores.append(score[j]);
+        }
+
+        if (scores.isEmpty())
+            return -std::numeric_limits<float>::max();
+        return reduce(scores);
+    }
+
+    float reduce(QVector<float> &scores) const
+    {
+        switch (reduction) {
+          case Max:
+            return *std::max_element(scores.begin(), scores.end());
+          case Min:
+            return *std::min_element(scores.begin(), scores.end());
+          case TopKMean: {
+            const int n = (k < 1) ? scores.size() : std::min(k, scores.size());
+            std::nth_element(scores.begin(), scores.begin() + (n-1), scores.end(), std::greater<float>());
+            return mean(scores.constData(), n);
+          }
+          case Softmax: {
+            // Shifting by the best score keeps the exponentials finite
+            const float best = *std::max_element(scores.begin(), scores.end());
+            double weightedSum = 0, weights = 0;
+            foreach (float score, scores) {
+                const double weight = exp((score - best) / temperature);
+                weightedSum += weight * score;
+                weights += weight;
+            }
+            return weightedSum / weights;
+          }
+          case Mean:
+            return mean(scores.constData(), scores.size());
+          default:
+            qFatal("Invalid reduction");
+        }
+        return -std::numeric_limits<float>::max();
+    }
+
+    static float mean(const float *scores, int size)
+    {
+        float sum = 0;
+        for (int i=0; i<size; i++)
+            sum += scores[i];
+        return sum / size;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+    }
+};
+
+BR_REGISTER(Distance, SetDistance)
+
+} // namespace br
+
+#include "distance/set.moc"
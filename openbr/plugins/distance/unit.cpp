@@ -24,7 +24,7 @@ namespace br
  * \brief Linear normalizes of a distance so the mean impostor score is 0 and the mean genuine score is 1.
  * \author Josh Klontz \cite jklontz
  */
-class UnitDistance : public Distance
+class UnitDistance : public ScoreMapDistance
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance)
@@ -74,9 +74,14 @@ class UnitDistance : public Distance
         qDebug("a = %f, b = %f", a, b);
     }
 
-    float compare(const Template &target, const Template &query) const
+    ScoreMap scoreMap() const
     {
-        return a * (distance->compare(target, query) - b);
+        return ScoreMap(ScoreMap::Affine, a, b);
+    }
+
+    Distance *wrapped() const
+    {
+        return distance;
     }
 };
 
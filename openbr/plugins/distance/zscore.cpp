@@ -20,7 +20,7 @@
 namespace br
 {
 
-class ZScoreDistance : public Distance
+class ZScoreDistance : public ScoreMapDistance
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
@@ -55,13 +55,14 @@ class ZScoreDistance : public Distance
         if (stddev == 0) qFatal("Stddev is 0.");
     }
 
-    float compare(const Template &target, const Template &query) const
+    ScoreMap scoreMap() const
     {
-        float score = distance->compare(target,query);
-        if      (score == -std::numeric_limits<float>::max()) score = (min - mean) / stddev;
-        else if (score ==  std::numeric_limits<float>::max()) score = (max - mean) / stddev;
-        else                                                  score = (score - mean) / stddev;
-        return score;
+        return ScoreMap(ScoreMap::Standardize, mean, stddev, (min - mean) / stddev, (max - mean) / stddev);
+    }
+
+    Distance *wrapped() const
+    {
+        return distance;
     }
 
     void store(QDataStream &stream) const
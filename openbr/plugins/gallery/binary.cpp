@@ -24,6 +24,7 @@
 #endif // _WIN32
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 #include <openbr/core/qtutils.h>
 #include <openbr/universal_template.h>
 
@@ -158,11 +159,15 @@ protected:
  *
  * Designed to be a literal translation of templates to disk.
  * Compatible with TemplateList::fromBuffer.
+ * If half is set, single precision matrices are written in half precision, as by CvtHalf, and read back that way,
+ * as \c CV_16U matrices that need Dist(half=true), L2(half=true) or CvtFloat(half=true) to be interpreted.
  * \author Josh Klontz \cite jklontz
  */
 class galGallery : public BinaryGallery
 {
     Q_OBJECT
+    Q_PROPERTY(bool half READ get_half WRITE set_half RESET reset_half STORED false)
+    BR_PROPERTY(bool, half, false)
 
     Template readTemplate()
     {
@@ -177,9 +182,26 @@ class galGallery : public BinaryGallery
             return;
         else if (t.file.fte)
             stream << Template(t.file); // only write metadata for failure to enroll
+        else if (half)
+            stream << toHalf(t);
         else
             stream << t;
     }
+
+    static Template toHalf(const Template &t)
+    {
+        Template h(t.file);
+        foreach (const cv::Mat &m, t) {
+            if (m.depth() != CV_32F) {
+                h.append(m);
+                continue;
+            }
+            cv::Mat converted;
+            OpenCVUtils::cvtHalf(m, converted);
+            h.append(converted);
+        }
+        return h;
+    }
 };
 
 BR_REGISTER(Gallery, galGallery)
@@ -0,0 +1,109 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/ivf.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief An inverted file index for approximate search of enrolled templates.
+ *
+ * Templates written to the gallery are clustered into nlist coarse k-means centroids when the gallery is closed,
+ * for example with <tt>br -convert Gallery watchlist.gal watchlist.ivf[nlist=4096]</tt>.
+ * Reading the gallery returns the templates in their original order.
+ * Comparing against an .ivf target gallery searches only the nprobe lists nearest each query,
+ * see IVFCompareTransform.
+ * \param nlist Number of inverted lists, defaults to four times the square root of the gallery size.
+ */
+class ivfGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int nlist READ get_nlist WRITE set_nlist RESET reset_nlist STORED false)
+    BR_PROPERTY(int, nlist, 0)
+
+    TemplateList written;
+    InvertedFile index;
+    bool loaded;
+    int offset;
+
+    ~ivfGallery()
+    {
+        if (written.isEmpty())
+            return;
+
+        index.build(written, nlist);
+        index.store(file.name);
+    }
+
+    void init()
+    {
+        loaded = false;
+        offset = 0;
+    }
+
+    void readOpen()
+    {
+        if (loaded)
+            return;
+        if (!file.exists())
+            qFatal("File %s does not exist", qPrintable(file.name));
+        index.load(file.name);
+        loaded = true;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        readOpen();
+        if (offset >= index.templates.size())
+            offset = 0;
+
+        TemplateList templates = index.templates.mid(offset, readBlockSize);
+        offset += templates.size();
+        for (int i=0; i<templates.size(); i++)
+            templates[i].file.set("progress", offset);
+
+        *done = offset >= index.templates.size();
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+        written.append(t);
+    }
+
+    qint64 totalSize()
+    {
+        readOpen();
+        return index.templates.size();
+    }
+
+    qint64 position()
+    {
+        return offset;
+    }
+};
+
+BR_REGISTER(Gallery, ivfGallery)
+
+} // namespace br
+
+#include "gallery/ivf.moc"
@@ -24,6 +24,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Approximate floats as signed bit.
+ *
+ * Compare the resulting codes with the Hamming distance, see also ITQ for trained binarization.
  * \author Josh Klontz \cite jklontz
  */
 class BinarizeTransform : public UntrainableTransform
@@ -38,14 +40,14 @@ class BinarizeTransform : public UntrainableTransform
         Mat n(m.rows, m.cols/8, CV_8UC1);
         for (int i=0; i<m.rows; i++)
             for (int j=0; j<m.cols-7; j+=8)
-                n.at<uchar>(i,j) = ((m.at<float>(i,j+0) > 0) << 0) +
-                                   ((m.at<float>(i,j+1) > 0) << 1) +
-                                   ((m.at<float>(i,j+2) > 0) << 2) +
-                                   ((m.at<float>(i,j+3) > 0) << 3) +
-                                   ((m.at<float>(i,j+4) > 0) << 4) +
-                                   ((m.at<float>(i,j+5) > 0) << 5) +
-                                   ((m.at<float>(i,j+6) > 0) << 6) +
-                                   ((m.at<float>(i,j+7) > 0) << 7);
+                n.at<uchar>(i,j/8) = ((m.at<float>(i,j+0) > 0) << 0) +
+                                     ((m.at<float>(i,j+1) > 0) << 1) +
+                                     ((m.at<float>(i,j+2) > 0) << 2) +
+                                     ((m.at<float>(i,j+3) > 0) << 3) +
+                                     ((m.at<float>(i,j+4) > 0) << 4) +
+                                     ((m.at<float>(i,j+5) > 0) << 5) +
+                                     ((m.at<float>(i,j+6) > 0) << 6) +
+                                     ((m.at<float>(i,j+7) > 0) << 7);
         dst = n;
     }
 };
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -24,15 +25,19 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Convert to floating point format.
+ *
+ * If \em half is set, \c CV_16U matrices are read as IEEE half precision values, undoing CvtHalf.
  * \author Josh Klontz \cite jklontz
  */
 class CvtFloatTransform : public UntrainableTransform
 {
     Q_OBJECT
+    Q_PROPERTY(bool half READ get_half WRITE set_half RESET reset_half STORED false)
+    BR_PROPERTY(bool, half, false)
 
     void project(const Template &src, Template &dst) const
     {
-        src.m().convertTo(dst, CV_32F);
+        OpenCVUtils::cvtFloat(src, dst, half);
     }
 };
 
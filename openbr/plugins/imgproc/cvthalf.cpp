@@ -0,0 +1,44 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Convert to IEEE half precision format, halving the size of floating point templates.
+ *
+ * OpenCV 2.4 has no half precision depth, so the 2-byte values are stored as \c CV_16U and plugins must be told to read them as halves.
+ * Dist(half=true) and L2(half=true) compare them directly, CvtFloat(half=true) converts them back to single precision.
+ */
+class CvtHalfTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+    void project(const Template &src, Template &dst) const
+    {
+        OpenCVUtils::cvtHalf(src, dst);
+    }
+};
+
+BR_REGISTER(Transform, CvtHalfTransform)
+
+} // namespace br
+
+#include "imgproc/cvthalf.moc"
@@ -0,0 +1,123 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <Eigen/Dense>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/eigenutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Binarize with a trained rotation, packing one bit per dimension.
+ *
+ * Training learns the mean of the data and an orthogonal rotation of the centered data minimizing its error
+ * from the nearest corner of the hypercube, following Gong and Lazebnik's
+ * "Iterative Quantization: A Procrustean Approach to Learning Binary Codes", CVPR 2011.
+ * Each bit is the sign of a centered and rotated dimension, packed eight per byte in the order of Binarize.
+ * Intended to follow a dimensionality reduction such as PCA, its codes are compared with the Hamming distance.
+ * With zero iterations the rotation is the identity, binarizing the centered data directly.
+ */
+class ITQTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
+    BR_PROPERTY(int, iterations, 50)
+
+    Eigen::VectorXf mean;
+    Eigen::MatrixXf rotation;
+
+    void train(const TemplateList &data)
+    {
+        if (data.first().m().type() != CV_32FC1)
+            qFatal("Requires single channel 32-bit floating point matrices.");
+
+        const int dimensions = data.first().m().rows * data.first().m().cols;
+        const int instances = data.size();
+
+        // One centered sample per row
+        Eigen::MatrixXf samples(instances, dimensions);
+        for (int i=0; i<instances; i++)
+            samples.row(i) = Eigen::Map<const Eigen::RowVectorXf>(data[i].m().ptr<float>(), dimensions);
+        mean = samples.colwise().mean().transpose();
+        samples.rowwise() -= mean.transpose();
+
+        if (iterations <= 0) {
+            rotation = Eigen::MatrixXf::Identity(dimensions, dimensions);
+            return;
+        }
+
+        // Start from a random rotation
+        cv::RNG &rng = cv::theRNG();
+        Eigen::MatrixXf gaussian(dimensions, dimensions);
+        for (int i=0; i<dimensions; i++)
+            for (int j=0; j<dimensions; j++)
+                gaussian(i, j) = rng.gaussian(1);
+        rotation = Eigen::HouseholderQR<Eigen::MatrixXf>(gaussian).householderQ();
+
+        // Alternate between the best codes for the rotation and the best rotation for the codes
+        for (int iteration=0; iteration<iterations; iteration++) {
+            const Eigen::MatrixXf codes = signs(samples * rotation);
+            Eigen::JacobiSVD<Eigen::MatrixXf> svd(codes.transpose() * samples, Eigen::ComputeFullU | Eigen::ComputeFullV);
+            rotation = svd.matrixV() * svd.matrixU().transpose();
+        }
+
+        if (Globals->verbose) {
+            const Eigen::MatrixXf rotated = samples * rotation;
+            qDebug("ITQ quantization error: %g", (signs(rotated) - rotated).squaredNorm() / instances);
+        }
+    }
+
+    // The corner of the hypercube nearest each row
+    static Eigen::MatrixXf signs(const Eigen::MatrixXf &m)
+    {
+        return ((m.array() > 0).cast<float>() * 2 - 1).matrix();
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const int dimensions = mean.size();
+        if ((src.m().type() != CV_32FC1) || (int(src.m().total()) != dimensions) || !src.m().isContinuous())
+            qFatal("Expected a continuous CV_32FC1 matrix with %d elements.", dimensions);
+
+        const Eigen::VectorXf rotated = rotation.transpose() * (Eigen::Map<const Eigen::VectorXf>(src.m().ptr<float>(), dimensions) - mean);
+
+        cv::Mat code(1, (dimensions + 7) / 8, CV_8UC1, cv::Scalar(0));
+        uchar *bytes = code.ptr();
+        for (int i=0; i<dimensions; i++)
+            if (rotated(i) > 0)
+                bytes[i/8] |= uchar(1 << (i%8));
+        dst = code;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << mean << rotation;
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> mean >> rotation;
+    }
+};
+
+BR_REGISTER(Transform, ITQTransform)
+
+} // namespace br
+
+#include "imgproc/itq.moc"
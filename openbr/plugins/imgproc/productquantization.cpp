@@ -18,6 +18,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
+#include <openbr/core/distance_sse.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -63,6 +64,50 @@ class ProductQuantizationDistance : public UntrainableDistance
         if (!bayesian) distance = -log(distance+1);
         return distance;
     }
+
+    bool batches() const { return true; }
+
+    // Asymmetric scoring, the triangular LUT entries for each query code are gathered once into a
+    // dense 256-entry table per sub-quantizer, after which each target code is a single lookup.
+    bool compareBatch(const Mat &targets, const Mat &queries, Mat &scores, float, float) const
+    {
+        if ((targets.type() != CV_8UC1) || (queries.type() != CV_8UC1) ||
+            (targets.cols != queries.cols) || (queries.cols <= int(sizeof(quint16))) || queries.empty() || targets.empty())
+            return false;
+
+        // Every code must come from the same quantizer
+        const quint16 index = *reinterpret_cast<const quint16*>(queries.ptr(0));
+        for (int i=0; i<queries.rows; i++)
+            if (*reinterpret_cast<const quint16*>(queries.ptr(i)) != index) return false;
+        for (int i=0; i<targets.rows; i++)
+            if (*reinterpret_cast<const quint16*>(targets.ptr(i)) != index) return false;
+
+        const int elements = queries.cols-sizeof(quint16);
+        const float *lut = (const float*)ProductQuantizationLUTs[index].data;
+        scores.create(queries.rows, targets.rows, CV_32FC1);
+        QVector<float> tables(elements*256);
+
+        for (int i=0; i<queries.rows; i++) {
+            const uchar *query = queries.ptr(i) + sizeof(quint16);
+            for (int j=0; j<elements; j++) {
+                const float *triangle = lut + j*256*(256+1)/2;
+                float *table = tables.data() + j*256;
+                const int q = query[j];
+                for (int c=0; c<=q; c++)
+                    table[c] = triangle[c + (q+1)*q/2];
+                for (int c=q+1; c<256; c++)
+                    table[c] = triangle[q + (c+1)*c/2];
+            }
+
+            float *score = scores.ptr<float>(i);
+            for (int k=0; k<targets.rows; k++) {
+                const float distance = lookup_sum(tables.constData(), targets.ptr(k) + sizeof(quint16), elements);
+                score[k] = bayesian ? distance : -log(distance+1);
+            }
+        }
+
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, ProductQuantizationDistance)
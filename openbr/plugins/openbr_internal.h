@@ -485,6 +485,67 @@ private:
     void train(const TemplateList &data) { (void) data; }
 };
 
+/*!
+ * \brief An element-wise function of a score, as applied by a br::ScoreMapDistance.
+ */
+struct ScoreMap
+{
+    enum Kind { Affine, /*!< a*(score-b) */
+                NegativeLogPlusOne, /*!< -log(score+1) */
+                Standardize /*!< (score-a)/b, with the infinite scores -max and max mapped to low and high */ };
+
+    Kind kind;
+    double a, b;
+    float low, high;
+
+    ScoreMap(Kind kind = Affine, double a = 1, double b = 0, float low = 0, float high = 0)
+        : kind(kind), a(a), b(b), low(low), high(high) {}
+
+    inline float operator()(float score) const
+    {
+        switch (kind) {
+          case Affine:
+            return float(a) * (score - float(b));
+          case NegativeLogPlusOne:
+            return -log(score+1);
+          default:
+            if (score == -std::numeric_limits<float>::max()) return low;
+            if (score ==  std::numeric_limits<float>::max()) return high;
+            return (score - a) / b;
+        }
+    }
+
+    /*!
+     * \brief Map score bounds (see br::Distance::compareBounded) to the corresponding bounds on the argument of the function.
+     */
+    void invert(float &lower, float &upper) const;
+};
+
+/*!
+ * \brief A br::Distance applying a br::ScoreMap to the scores of a single wrapped distance.
+ *
+ * simplify() fuses a chain of these into one distance, which scores whole tiles with the innermost distance
+ * and then applies every function in a single pass over the scores.
+ */
+class BR_EXPORT ScoreMapDistance : public Distance
+{
+    Q_OBJECT
+
+public:
+    virtual ScoreMap scoreMap() const = 0; /*!< \brief The function applied to the scores of wrapped(). */
+    virtual Distance *wrapped() const = 0; /*!< \brief The wrapped distance. */
+    Distance *simplify(bool &newDistance);
+    void prepareTargets(const TemplateList &targets) { wrapped()->prepareTargets(targets); }
+    bool batches() const { return wrapped()->batches(); }
+    bool symmetric() const { return wrapped()->symmetric(); }
+
+private:
+    float compare(const Template &a, const Template &b) const;
+    float compareBounded(const Template &a, const Template &b, float lower, float upper) const;
+    bool compareBatch(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores, float lower, float upper) const;
+    bool compareProducts(const cv::Mat &products, const cv::Mat &targetNorms, const cv::Mat &queryNorms, cv::Mat &scores) const;
+};
+
 }
 
 #endif // OPENBR_INTERNAL_H
@@ -14,10 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <algorithm>
+#include <vector>
+
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
 #include <openbr/core/qtutils.h>
-#include <openbr/core/opencvutils.h>
 
 namespace br
 {
@@ -25,46 +27,168 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Outputs highest ranked matches with scores.
+ *
+ * Ranks are computed as scores arrive instead of sorting a full similarity matrix.
+ * For each query only the best genuine match so far and the impostors scoring ahead of it are retained,
+ * so ranks are exact and rows with an early, well ranked genuine match hold little.
+ * Setting the optional \em maxRank parameter keeps at most that many impostors per row being scored,
+ * in which case genuine matches ranked beyond it are reported at maxRank+1.
+ * Queries whose label isn't in the gallery can't be ranked and retain nothing.
  * \author Scott Klum \cite sklum
  */
-class rankOutput : public MatrixOutput
+class rankOutput : public Output
 {
     Q_OBJECT
 
+    // A target in the sort order of a row, higher scores first and ties broken by higher index
+    struct Match
+    {
+        float score;
+        int target;
+
+        Match(float _score = -std::numeric_limits<float>::max(), int _target = -1)
+            : score(_score), target(_target) {}
+
+        bool ahead(const Match &other) const
+        {
+            return (score > other.score) || ((score == other.score) && (target > other.target));
+        }
+
+        // Min-heap order for std::*_heap, the front is the match furthest behind
+        bool operator<(const Match &other) const
+        {
+            return ahead(other);
+        }
+    };
+
+    struct Row
+    {
+        Match genuine;
+        std::vector<Match> impostors; // Min-heap of the impostors ahead of the genuine match
+        bool overflow;
+        int received;
+        int rank;
+
+        Row() : overflow(false), received(0), rank(0) {}
+    };
+
+    QVector<int> targetLabels, queryLabels;
+    QVector<int> targetPartitions, queryPartitions;
+    QVector< QList<int> > sameName;
+    QVector<Row> rows;
+    int maxRank;
+
+    static const int Stripes = 64;
+    QMutex locks[Stripes];
+
     ~rankOutput()
     {
         if (targetFiles.isEmpty() || queryFiles.isEmpty()) return;
 
         QList<int> ranks;
-        QList<int> positions;
-        QList<float> scores;
+        QList<int> queries;
+        for (int i=0; i<rows.size(); i++) {
+            if (rows[i].received < targetFiles.size())
+                finish(rows[i]);
+            if (rows[i].rank > 0) {
+                ranks.append(rows[i].rank);
+                queries.append(i);
+            }
+        }
+
         QStringList lines;
+        typedef QPair<int,int> RankPair;
+        foreach (const RankPair &pair, Common::Sort(ranks, false)) {
+            // pair.first == rank retrieved, pair.second == position in ranks
+            const Row &row = rows[queries[pair.second]];
+            lines.append(queryFiles[queries[pair.second]].name + " " + QString::number(pair.first) + " " + QString::number(row.genuine.score) + " " + targetFiles[row.genuine.target].name);
+        }
+
+        QtUtils::writeFile(file, lines);
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        maxRank = std::max(1, file.get<int>("maxRank", std::numeric_limits<int>::max()));
+
+        // Outputs may be initialized again, for example with a new block layout
+        targetLabels.clear();
+        queryLabels.clear();
+        targetPartitions.clear();
+        queryPartitions.clear();
+        sameName.clear();
+
+        // Integer ids for the labels, partitions and names compared per score
+        QHash<QString, int> labels;
+        foreach (const File &target, targetFiles) {
+            const QString label = target.get<QString>("Label");
+            if (!labels.contains(label)) labels.insert(label, labels.size());
+            targetLabels.append(labels[label]);
+        }
+        foreach (const File &query, queryFiles)
+            queryLabels.append(labels.value(query.get<QString>("Label"), -1));
+
+        if (Globals->crossValidate > 0) {
+            foreach (const File &target, targetFiles)
+                targetPartitions.append(target.get<int>("Partition", -1));
+            foreach (const File &query, queryFiles)
+                queryPartitions.append(query.get<int>("Partition", -1));
+        }
+
+        QHash<QString, QList<int> > targetsByName;
+        for (int j=0; j<targetFiles.size(); j++)
+            targetsByName[targetFiles[j].name].append(j);
+        foreach (const File &query, queryFiles)
+            sameName.append(targetsByName.value(query.name));
+
+        rows = QVector<Row>(queryFiles.size());
+    }
+
+    void set(float value, int i, int j)
+    {
+        QMutexLocker locker(&locks[i % Stripes]);
+        Row &row = rows[i];
+        row.received++;
 
-        for (int i=0; i<queryFiles.size(); i++) {
-            typedef QPair<float,int> Pair;
-            int rank = 1;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true)) {
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
-                    if (QString(targetFiles[pair.second]) != QString(queryFiles[i])) {
-                        if (targetFiles[pair.second].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
-                            ranks.append(rank);
-                            positions.append(pair.second);
-                            scores.append(pair.first);
-                            break;
-                        }
-                        rank++;
+        // Without a mate in the gallery there is no rank to compute
+        if (queryLabels[i] == -1)
+            return;
+
+        const bool eligible = (targetPartitions.isEmpty() || (targetPartitions[j] == -1) || (targetPartitions[j] == queryPartitions[i])) &&
+                              !sameName[i].contains(j);
+        if (eligible) {
+            const Match match(value, j);
+            if (targetLabels[j] == queryLabels[i]) {
+                if ((row.genuine.target == -1) || match.ahead(row.genuine)) {
+                    row.genuine = match;
+                    while (!row.impostors.empty() && !row.impostors.front().ahead(row.genuine)) {
+                        std::pop_heap(row.impostors.begin(), row.impostors.end());
+                        row.impostors.pop_back();
+                        row.overflow = false;
                     }
                 }
+            } else if ((row.genuine.target == -1) || match.ahead(row.genuine)) {
+                row.impostors.push_back(match);
+                std::push_heap(row.impostors.begin(), row.impostors.end());
+                if ((int)row.impostors.size() > maxRank) {
+                    std::pop_heap(row.impostors.begin(), row.impostors.end());
+                    row.impostors.pop_back();
+                    row.overflow = true;
+                }
             }
         }
 
-        typedef QPair<int,int> RankPair;
-        foreach (const RankPair &pair, Common::Sort(ranks, false))
-            // pair.first == rank retrieved, pair.second == original position
-            lines.append(queryFiles[pair.second].name + " " + QString::number(pair.first) + " " + QString::number(scores[pair.second]) + " " + targetFiles[positions[pair.second]].name);
-
+        if (row.received == targetFiles.size())
+            finish(row);
+    }
 
-        QtUtils::writeFile(file, lines);
+    // Record the rank of a completed row and release its impostors
+    void finish(Row &row)
+    {
+        if (row.genuine.target != -1)
+            row.rank = row.overflow ? maxRank + 1 : int(row.impostors.size()) + 1;
+        std::vector<Match>().swap(row.impostors);
     }
 };
 
@@ -14,10 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <algorithm>
+#include <vector>
+
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/common.h>
 #include <openbr/core/qtutils.h>
-#include <openbr/core/opencvutils.h>
 
 namespace br
 {
@@ -25,17 +26,29 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Rank retrieval output.
+ *
+ * Each query keeps a bounded heap of its \em limit best matches as scores arrive,
+ * rather than sorting a full similarity matrix.
  * \author Josh Klontz \cite jklontz
  * \author Scott Klum \cite sklum
  */
-class rrOutput : public MatrixOutput
+class rrOutput : public Output
 {
     Q_OBJECT
 
+    // Higher scores first and ties broken by higher index, the front of a heap is the worst match
+    typedef QPair<float,int> Match;
+    typedef std::vector<Match> Heap;
+
+    QVector<Heap> heaps;
+    int limit;
+
+    static const int Stripes = 64;
+    QMutex locks[Stripes];
+
     ~rrOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const int limit = file.get<int>("limit", 20);
         const bool byLine = file.getBool("byLine");
         const bool simple = file.getBool("simple");
         const float threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
@@ -46,8 +59,9 @@ class rrOutput : public MatrixOutput
             QStringList files;
             if (simple) files.append(queryFiles[i].fileName());
 
-            typedef QPair<float,int> Pair;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true, limit)) {
+            Heap &heap = heaps[i];
+            std::sort_heap(heap.begin(), heap.end(), std::greater<Match>());
+            foreach (const Match &pair, heap) {
                 if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
                     if (pair.first < threshold) break;
                     File target = targetFiles[pair.second];
@@ -61,6 +75,28 @@ class rrOutput : public MatrixOutput
 
         QtUtils::writeFile(file, lines);
     }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        limit = file.get<int>("limit", 20);
+        heaps = QVector<Heap>(queryFiles.size());
+    }
+
+    void set(float value, int i, int j)
+    {
+        const Match match(value, j);
+        QMutexLocker locker(&locks[i % Stripes]);
+        Heap &heap = heaps[i];
+        if ((int)heap.size() < limit) {
+            heap.push_back(match);
+            std::push_heap(heap.begin(), heap.end(), std::greater<Match>());
+        } else if ((limit > 0) && (match > heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Match>());
+            heap.back() = match;
+            std::push_heap(heap.begin(), heap.end(), std::greater<Match>());
+        }
+    }
 };
 
 BR_REGISTER(Output, rrOutput)
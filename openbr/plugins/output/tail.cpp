@@ -13,8 +13,11 @@
  * See the License for the specific language governing permissions and       *
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-#include <openbr/plugins/openbr_internal.h>
+#include <QThreadStorage>
+#include <algorithm>
+#include <vector>
 
+#include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
 
 namespace br
@@ -23,6 +26,10 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief The highest scoring matches.
+ *
+ * Each comparison thread keeps its own bounded min-heap of (score, query, target) indices,
+ * so setting a score never takes a lock.
+ * The heaps are merged when the output is written, and only the surviving matches are resolved to files.
  * \author Josh Klontz \cite jklontz
  */
 class tailOutput : public Output
@@ -31,37 +38,66 @@ class tailOutput : public Output
 
     struct Comparison
     {
-        br::File query, target;
         float value;
+        int query, target;
 
-        Comparison(const br::File &_query, const br::File &_target, float _value)
-            : query(_query), target(_target), value(_value) {}
-
-        QString toString(bool args) const
-        {
-            return QString::number(value) + "," + (args ? target.flat() : (QString)target) + "," + (args ? query.flat() : (QString)query);
-        }
+        Comparison(float _value, int _query, int _target)
+            : value(_value), query(_query), target(_target) {}
 
+        // Higher scores first, ties broken by position for a deterministic order
         bool operator<(const Comparison &other) const
         {
-            return value < other.value;
+            if (value != other.value) return value > other.value;
+            if (query != other.query) return query < other.query;
+            return target < other.target;
         }
     };
 
+    // Min-heap of the best comparisons seen by one thread
+    typedef std::vector<Comparison> Heap;
+
+    struct ThreadCache
+    {
+        int owner;
+        Heap *heap;
+        ThreadCache() : owner(0), heap(NULL) {}
+    };
+
+    static QAtomicInt serials;
+    static QThreadStorage<ThreadCache> threadCache;
+
     float threshold;
     int atLeast, atMost;
     bool args;
-    float lastValue;
-    QList<Comparison> comparisons;
-    QMutex comparisonsLock;
+    int serial;
+    QHash<QThread*, QSharedPointer<Heap> > heaps;
+    QMutex heapsLock;
 
     ~tailOutput()
     {
-        if (file.isNull() || comparisons.isEmpty()) return;
-        QStringList lines; lines.reserve(comparisons.size()+1);
+        if (file.isNull()) return;
+
+        // Merge the per-thread heaps, applying the selection criteria to the combined list
+        QList<Comparison> comparisons;
+        foreach (const QSharedPointer<Heap> &heap, heaps)
+            for (size_t i=0; i<heap->size(); i++)
+                comparisons.append((*heap)[i]);
+        std::sort(comparisons.begin(), comparisons.end());
+
+        int count = 0;
+        while ((count < comparisons.size()) && (count < atMost) &&
+               ((count < atLeast) || (comparisons[count].value >= threshold)))
+            count++;
+        if (count == 0) return;
+
+        QStringList lines; lines.reserve(count+1);
         lines.append("Value,Target,Query");
-        foreach (const Comparison &duplicate, comparisons)
-            lines.append(duplicate.toString(args));
+        for (int i=0; i<count; i++) {
+            const Comparison &comparison = comparisons[i];
+            const File &target = targetFiles[comparison.target];
+            const File &query = queryFiles[comparison.query];
+            lines.append(QString::number(comparison.value) + "," + (args ? target.flat() : (QString)target) + "," + (args ? query.flat() : (QString)query));
+        }
         QtUtils::writeFile(file, lines);
     }
 
@@ -72,7 +108,27 @@ class tailOutput : public Output
         atLeast = file.get<int>("atLeast", 1);
         atMost = file.get<int>("atMost", std::numeric_limits<int>::max());
         args = file.get<bool>("args", false);
-        lastValue = -std::numeric_limits<float>::max();
+        serial = serials.fetchAndAddRelaxed(1) + 1;
+    }
+
+    Heap &localHeap()
+    {
+        ThreadCache &cache = threadCache.localData();
+        if (cache.owner != serial) {
+            // First score from this thread since it last worked on a different output
+            QMutexLocker locker(&heapsLock);
+            QSharedPointer<Heap> &heap = heaps[QThread::currentThread()];
+            if (heap.isNull()) heap = QSharedPointer<Heap>(new Heap());
+            cache.owner = serial;
+            cache.heap = heap.data();
+        }
+        return *cache.heap;
+    }
+
+    // Scores below the threshold are discarded unless needed to reach atLeast
+    float bound() const
+    {
+        return atLeast > 0 ? -std::numeric_limits<float>::max() : threshold;
     }
 
     void set(float value, int i, int j)
@@ -80,34 +136,30 @@ class tailOutput : public Output
         // Return early for self similar matrices
         if (selfSimilar && (i <= j)) return;
 
-        // Consider only values passing the criteria
-        if ((value < threshold) && (value <= lastValue) && (comparisons.size() >= atLeast))
-            return;
+        Heap &heap = localHeap();
 
-        comparisonsLock.lock();
-        if (comparisons.isEmpty() || (value < comparisons.last().value)) {
-            // Special cases
-            comparisons.append(Comparison(queryFiles[i], targetFiles[j], value));
-        } else {
-            // General case
-            for (int k=0; k<comparisons.size(); k++) {
-                if (comparisons[k].value <= value) {
-                    comparisons.insert(k, Comparison(queryFiles[i], targetFiles[j], value));
-                    break;
-                }
-            }
-        }
+        // Consider only values passing the criteria, heap.front() is the lowest score kept
+        if ((value < threshold) && ((int)heap.size() >= atLeast) && (heap.empty() || (value <= heap.front().value)))
+            return;
 
-        while (comparisons.size() > atMost)
-            comparisons.removeLast();
-        while ((comparisons.size() > atLeast) && (comparisons.last().value < threshold))
-            comparisons.removeLast();
+        // std::*_heap with operator< keeps the worst comparison at the front
+        heap.push_back(Comparison(value, i, j));
+        std::push_heap(heap.begin(), heap.end());
 
-        lastValue = comparisons.last().value;
-        comparisonsLock.unlock();
+        while ((int)heap.size() > atMost) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+        while (((int)heap.size() > atLeast) && (heap.front().value < threshold)) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
     }
 };
 
+QAtomicInt tailOutput::serials;
+QThreadStorage<tailOutput::ThreadCache> tailOutput::threadCache;
+
 BR_REGISTER(Output, tailOutput)
 
 } // namespace br